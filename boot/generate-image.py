@@ -11,11 +11,15 @@ def sh(command):
     assert system(command) == 0
 
 sector_size = 512
-n_sectors = 256 * 1024
+n_sectors = 512 * 1024
 boot_offset = 2048
 n_boot_sectors = 128 * 1024
 filesystem_offset = boot_offset + n_boot_sectors
-n_filesystem_sectors = n_sectors - filesystem_offset
+n_filesystem_sectors = 64 * 1024
+# the file system only needs a few MiB (FSSIZE in src/fs/defines.h); the rest
+# of the disk is the swap area, found by type in src/kernel/swap.c.
+swap_offset = filesystem_offset + n_filesystem_sectors
+n_swap_sectors = n_sectors - swap_offset
 
 def generate_boot_image(target, files):
     sh(f'dd if=/dev/zero of={target} seek={n_boot_sectors - 1} bs={sector_size} count=1')
@@ -41,7 +45,8 @@ def generate_sd_image(target, boot_image, fs_image):
 
     boot_line = f'{boot_offset}, {n_boot_sectors * sector_size // 1024}K, c,'
     filesystem_line = f'{filesystem_offset}, {n_filesystem_sectors * sector_size // 1024}K, L,'
-    sh(f'printf "{boot_line}\\n{filesystem_line}\\n" | sfdisk {target}')
+    swap_line = f'{swap_offset}, {n_swap_sectors * sector_size // 1024}K, S,'
+    sh(f'printf "{boot_line}\\n{filesystem_line}\\n{swap_line}\\n" | sfdisk {target}')
 
     sh(f'dd if={boot_image} of={target} seek={boot_offset} conv=notrunc')
     sh(f'dd if={fs_image} of={target} seek={filesystem_offset} conv=notrunc')
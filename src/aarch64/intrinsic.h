@@ -160,12 +160,67 @@ static ALWAYS_INLINE void arch_tlbi_vmalle1is()
     arch_fence();
 }
 
-/* Set Translation Table Base Register 0 (EL1). */
+/* Flush TLB entries tagged with `asid`. */
+static ALWAYS_INLINE void arch_tlbi_aside1is(u64 asid)
+{
+    arch_fence();
+    asm volatile("tlbi aside1is, %[x]" : : [x] "r"(asid << 48));
+    arch_fence();
+}
+
+/* Flush TLB entries (all levels) of `va` tagged with `asid`. */
+static ALWAYS_INLINE void arch_tlbi_vae1is(u64 asid, u64 va)
+{
+    arch_fence();
+    asm volatile("tlbi vae1is, %[x]"
+                 :
+                 : [x] "r"(asid << 48 | ((va >> 12) & 0xFFFFFFFFFFF)));
+    arch_fence();
+}
+
+/*
+ * Like `arch_tlbi_vae1is`, without the barriers, to flush many pages at once:
+ * issue them between `arch_dsb_ishst` and `arch_dsb_ish` + `arch_isb`.
+ */
+static ALWAYS_INLINE void arch_tlbi_vae1is_nosync(u64 asid, u64 va)
+{
+    asm volatile("tlbi vae1is, %[x]"
+                 :
+                 : [x] "r"(asid << 48 | ((va >> 12) & 0xFFFFFFFFFFF)));
+}
+
+/* Make the page table stores visible to the table walkers of all CPUs. */
+static ALWAYS_INLINE void arch_dsb_ishst()
+{
+    asm volatile("dsb ishst" ::: "memory");
+}
+
+/* Wait for the TLB invalidations issued so far on all CPUs. */
+static ALWAYS_INLINE void arch_dsb_ish()
+{
+    asm volatile("dsb ish" ::: "memory");
+}
+
+/* Flush the last-level TLB entry of `va` tagged with `asid`. */
+static ALWAYS_INLINE void arch_tlbi_vale1is(u64 asid, u64 va)
+{
+    arch_fence();
+    asm volatile("tlbi vale1is, %[x]"
+                 :
+                 : [x] "r"(asid << 48 | ((va >> 12) & 0xFFFFFFFFFFF)));
+    arch_fence();
+}
+
+/*
+ * Set Translation Table Base Register 0 (EL1). Bits [63:48] of `addr` hold
+ * the ASID. No TLB maintenance is done here: entries of other address spaces
+ * are told apart by their ASID.
+ */
 static ALWAYS_INLINE void arch_set_ttbr0(u64 addr)
 {
     arch_fence();
     asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr));
-    arch_tlbi_vmalle1is();
+    arch_fence();
 }
 
 /* Get Translation Table Base Register 0 (EL1). */
@@ -32,13 +32,29 @@ typedef unsigned long long u64;
 #define PTE_USER (1 << 6)
 #define PTE_RO (1 << 7)
 #define PTE_RW (0 << 7)
+#define PTE_NG (1 << 11) // not global: TLB entries are tagged with the ASID
+#define PTE_CONT (1LL << 52) // contiguous hint, see CONT_PTES
 
 #define PTE_KERNEL_DATA (PTE_KERNEL | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KERNEL_DEVICE (PTE_KERNEL | PTE_DEVICE | PTE_BLOCK)
-#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE)
+#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE | PTE_NG)
+#define PTE_USER_BLOCK (PTE_USER | PTE_NORMAL | PTE_BLOCK | PTE_NG)
 
 #define N_PTE_PER_TABLE 512
 
+/* A level 2 entry may map a 2 MiB block instead of pointing to a table. */
+#define HUGE_PAGE_SIZE (PAGE_SIZE * N_PTE_PER_TABLE)
+#define HUGE_BASE(addr) ((u64)(addr) & ~(HUGE_PAGE_SIZE - 1))
+#define PTE_IS_BLOCK(pte) (((pte) & PTE_TABLE) == PTE_BLOCK) // levels 0 to 2 only
+
+/* An aligned group of so many PTEs mapping contiguous memory with the same
+   attributes may all carry PTE_CONT, then they share one TLB entry. */
+#define CONT_PTES 16
+
+/* TCR_EL1.AS = 0 and TCR_EL1.A1 = 0: 8-bit ASIDs, taken from TTBR0_EL1. */
+#define ASID_BITS 8
+#define TTBR_ASID_SHIFT 48
+
 #define PTE_HIGH_NX (1LL << 54)
 
 #define KSPACE_MASK 0xFFFF000000000000
@@ -9,8 +9,28 @@
 
 #define SPSR_EL1_DAIF_MASK 0xF
 
+/*
+ * Kernel code touching user memory (see `aarch64/uaccess.S`) lists every
+ * such instruction in `__ex_table`. If a fault there cannot be resolved,
+ * continue at its fixup address instead.
+ */
+static bool fixup_exception(UserContext *context) {
+    extern struct {
+        u64 insn, fixup;
+    } __start_ex_table[], __stop_ex_table[];
+    for (auto e = __start_ex_table; e < __stop_ex_table; e++) {
+        if (e->insn == context->elr) {
+            context->elr = e->fixup;
+            return true;
+        }
+    }
+    return false;
+}
+
 void trap_global_handler(UserContext *context) {
-    thisproc()->ucontext = context;
+    // traps taken in the kernel must not replace the saved user context.
+    if ((context->spsr & SPSR_EL1_DAIF_MASK) == 0)
+        thisproc()->ucontext = context;
 
     u64 esr = arch_get_esr();
     u64 ec = esr >> ESR_EC_SHIFT;
@@ -30,10 +50,18 @@ void trap_global_handler(UserContext *context) {
             syscall_entry(context);
         } break;
         case ESR_EC_IABORT_EL0:
+        case ESR_EC_DABORT_EL0: {
+            if (pgfault_handler(iss) < 0) {
+                int k = kill(thisproc()->pid);
+                ASSERT(k == 0);
+            }
+        } break;
         case ESR_EC_IABORT_EL1:
-        case ESR_EC_DABORT_EL0:
         case ESR_EC_DABORT_EL1: {
-            pgfault_handler(iss);
+            if (pgfault_handler(iss) < 0 && !fixup_exception(context)) {
+                int k = kill(thisproc()->pid);
+                ASSERT(k == 0);
+            }
         } break;
         default: {
             printk("Unknwon exception %llu\n", esr);
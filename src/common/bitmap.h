@@ -46,3 +46,31 @@ static INLINE void bitmap_clear(BitmapCell *bitmap, usize index)
     BITMAP_PARSE_INDEX(index, idx, offset);
     bitmap[idx] &= ~BIT(offset);
 }
+
+// find the first cleared bit at or after `from` and before `size`, one cell
+// at a time. return `size` if there is none.
+static INLINE usize bitmap_find_zero(BitmapCell *bitmap, usize from, usize size)
+{
+    usize first = from / BITMAP_BITS_PER_CELL;
+    for (usize idx = first; idx * BITMAP_BITS_PER_CELL < size; idx++) {
+        BitmapCell free = ~bitmap[idx];
+        if (idx == first)
+            free &= ~(BitmapCell)0 << (from % BITMAP_BITS_PER_CELL);
+        if (free) {
+            usize index = idx * BITMAP_BITS_PER_CELL + __builtin_ctzll(free);
+            return index < size ? index : size;
+        }
+    }
+    return size;
+}
+
+// count the set bits before `size`.
+static INLINE usize bitmap_count(BitmapCell *bitmap, usize size)
+{
+    usize count = 0, idx = 0;
+    for (; (idx + 1) * BITMAP_BITS_PER_CELL <= size; idx++)
+        count += __builtin_popcountll(bitmap[idx]);
+    if (size % BITMAP_BITS_PER_CELL)
+        count += __builtin_popcountll(bitmap[idx] & (BIT(size % BITMAP_BITS_PER_CELL) - 1));
+    return count;
+}
@@ -0,0 +1,51 @@
+#include <common/crc32c.h>
+
+// the CRC of each 4 bits, for the reflected polynomial 0x82f63b78.
+static const u32 nibble_table[16] = {
+    0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3,
+    0x61c69362, 0x7198540d, 0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+    0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+};
+
+static u32 crc32c_sw(u32 crc, const u8 *p, usize len) {
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ nibble_table[crc & 0xf];
+        crc = (crc >> 4) ^ nibble_table[crc & 0xf];
+    }
+    return crc;
+}
+
+#ifdef __aarch64__
+
+// ID_AA64ISAR0_EL1.CRC32, bits [19:16], is not 0 if the instructions exist.
+static bool has_crc32() {
+    static int has = -1;
+    if (has < 0) {
+        u64 isar0;
+        asm volatile("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+        has = ((isar0 >> 16) & 0xf) != 0;
+    }
+    return has;
+}
+
+static u32 crc32c_hw(u32 crc, const u8 *p, usize len) {
+    for (; len > 0 && ((u64)p & 7); len--)
+        asm(".arch_extension crc\n crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"((u32)*p++));
+    for (; len >= 8; len -= 8, p += 8)
+        asm(".arch_extension crc\n crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(*(const u64 *)p));
+    for (; len > 0; len--)
+        asm(".arch_extension crc\n crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"((u32)*p++));
+    return crc;
+}
+
+#endif
+
+u32 crc32c(u32 crc, const void *data, usize len) {
+    crc = ~crc;
+#ifdef __aarch64__
+    if (has_crc32())
+        return ~crc32c_hw(crc, data, len);
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <common/defines.h>
+
+/**
+ * CRC32C (Castagnoli) of `len` bytes at `data`, continued from `crc`, the
+ * CRC32C of the bytes before them (0 for none). So the CRC32C of a buffer
+ * can be computed in pieces.
+ *
+ * It uses the ARMv8 CRC32 instructions if the CPU has them.
+ */
+WARN_RESULT u32 crc32c(u32 crc, const void *data, usize len);
@@ -0,0 +1,124 @@
+#include <common/radix_tree.h>
+#include <common/string.h>
+#include <kernel/mem.h>
+
+#define MASK (RADIX_TREE_SLOTS - 1)
+
+// the largest index a tree of `height` can hold.
+static usize max_index(usize height) {
+    if (height * RADIX_TREE_BITS >= 64)
+        return (usize)-1;
+    return (1ull << (height * RADIX_TREE_BITS)) - 1;
+}
+
+// the shift of index bits resolved at `level` (0 is the root).
+static INLINE usize shift_of(RadixTree *tree, usize level) {
+    return (tree->height - 1 - level) * RADIX_TREE_BITS;
+}
+
+static RadixTreeNode *new_node() {
+    RadixTreeNode *node = kalloc(sizeof(RadixTreeNode));
+    memset(node, 0, sizeof(RadixTreeNode));
+    return node;
+}
+
+void init_radix_tree(RadixTree *tree) {
+    tree->root = NULL;
+    tree->height = 0;
+}
+
+void *radix_tree_lookup(RadixTree *tree, usize index) {
+    if (!tree->height || index > max_index(tree->height))
+        return NULL;
+    RadixTreeNode *node = tree->root;
+    for (usize l = 0; node && l + 1 < tree->height; l++)
+        node = node->slots[(index >> shift_of(tree, l)) & MASK];
+    return node ? node->slots[index & MASK] : NULL;
+}
+
+bool radix_tree_insert(RadixTree *tree, usize index, void *item) {
+    if (!tree->root) {
+        tree->root = new_node();
+        tree->height = 1;
+    }
+    while (index > max_index(tree->height)) {
+        RadixTreeNode *node = new_node();
+        node->slots[0] = tree->root;
+        node->count = 1;
+        tree->root = node;
+        tree->height++;
+    }
+
+    RadixTreeNode *node = tree->root;
+    for (usize l = 0; l + 1 < tree->height; l++) {
+        void **slot = &node->slots[(index >> shift_of(tree, l)) & MASK];
+        if (!*slot) {
+            *slot = new_node();
+            node->count++;
+        }
+        node = *slot;
+    }
+    if (node->slots[index & MASK])
+        return false;
+    node->slots[index & MASK] = item;
+    node->count++;
+    return true;
+}
+
+void *radix_tree_delete(RadixTree *tree, usize index) {
+    if (!tree->height || index > max_index(tree->height))
+        return NULL;
+
+    RadixTreeNode *path[RADIX_TREE_MAX_HEIGHT];
+    RadixTreeNode *node = tree->root;
+    for (usize l = 0;; l++) {
+        path[l] = node;
+        if (l + 1 == tree->height)
+            break;
+        node = node->slots[(index >> shift_of(tree, l)) & MASK];
+        if (!node)
+            return NULL;
+    }
+    void *item = node->slots[index & MASK];
+    if (!item)
+        return NULL;
+
+    // clear the slot, and free the nodes that become empty.
+    for (usize l = tree->height; l-- > 0;) {
+        path[l]->slots[(index >> shift_of(tree, l)) & MASK] = NULL;
+        if (--path[l]->count)
+            break;
+        kfree(path[l]);
+        if (l == 0)
+            init_radix_tree(tree);
+    }
+    return item;
+}
+
+// gang lookup in the subtree of `node`, which covers indexes from `base`.
+static usize gang_lookup(RadixTreeNode *node,
+                         usize shift,
+                         usize base,
+                         usize first,
+                         void **items,
+                         usize max) {
+    usize n = 0;
+    for (usize i = 0; i < RADIX_TREE_SLOTS && n < max; i++) {
+        usize lo = base + ((usize)i << shift);
+        usize hi = lo + ((1ull << shift) - 1);
+        if (!node->slots[i] || hi < first)
+            continue;
+        if (shift == 0)
+            items[n++] = node->slots[i];
+        else
+            n += gang_lookup(node->slots[i], shift - RADIX_TREE_BITS, lo,
+                             first, items + n, max - n);
+    }
+    return n;
+}
+
+usize radix_tree_gang_lookup(RadixTree *tree, usize first, void **items, usize max) {
+    if (!tree->height || first > max_index(tree->height))
+        return 0;
+    return gang_lookup(tree->root, shift_of(tree, 0), 0, first, items, max);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <common/defines.h>
+
+// radix tree maps a usize index to a non-NULL pointer.
+// each node resolves RADIX_TREE_BITS bits of the index, and the tree only
+// grows as high as the largest index needs.
+#define RADIX_TREE_BITS 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_BITS)
+#define RADIX_TREE_MAX_HEIGHT ((64 + RADIX_TREE_BITS - 1) / RADIX_TREE_BITS)
+
+typedef struct radix_tree_node {
+    void *slots[RADIX_TREE_SLOTS];
+    usize count;  // number of non-NULL slots
+} RadixTreeNode;
+
+typedef struct {
+    RadixTreeNode *root;
+    usize height;  // 0 if the tree is empty
+} RadixTree;
+
+/* NOTE: You should add lock when use */
+void init_radix_tree(RadixTree *tree);
+// return the item at `index`, or NULL.
+void *radix_tree_lookup(RadixTree *tree, usize index);
+// insert `item` at `index`. return false if `index` is already taken.
+WARN_RESULT bool radix_tree_insert(RadixTree *tree, usize index, void *item);
+// remove and return the item at `index`, or NULL if there is none.
+void *radix_tree_delete(RadixTree *tree, usize index);
+// fill `items` with at most `max` items whose index >= `first`, in index
+// order. return the number of items found.
+usize radix_tree_gang_lookup(RadixTree *tree, usize first, void **items, usize max);
@@ -11,6 +11,11 @@
  */
 #define NQUEUE 64 
 
+/**
+ * A request of so many blocks at most takes `VIRTIO_MAX_SEGS + 2` descriptors.
+ */
+#define VIRTIO_MAX_SEGS 16
+
 #define VIRTIO_REG_MAGICVALUE (VIRTIO0 + 0x00)
 #define VIRTIO_REG_VERSION (VIRTIO0 + 0x04)
 #define VIRTIO_REG_DEVICE_ID (VIRTIO0 + 0x08)
@@ -101,7 +106,7 @@ struct virtq {
     struct {
         volatile u8 status;
         volatile u8 done;
-        u8 *buf;
+        Semaphore *sem;
     } info[NQUEUE];
 };
 
@@ -122,4 +127,10 @@ enum diskop {
 };
 
 int virtio_blk_rw(Buf *b);
+
+/**
+ * Read / write `n` consecutive blocks from `block_no` in one request, with
+ * one descriptor for each buffer. `n` is at most `VIRTIO_MAX_SEGS`.
+ */
+int virtio_blk_rwv(u32 block_no, u8 **bufs, int n, bool write);
 void virtio_init(void);
@@ -12,6 +12,7 @@
 struct disk {
     SpinLock lk;
     struct virtq virtq;
+    Semaphore desc_sem;  // posted when descriptors are freed.
 } disk;
 
 static void desc_init(struct virtq *virtq)
@@ -57,58 +58,62 @@ static void free_desc(struct virtq *virtq, u16 n)
     virtq->free_head = head;
 }
 
-int virtio_blk_rw(Buf *b)
+// wait until `n` descriptors are free. caller must hold `disk.lk`.
+static void wait_for_desc(int n)
 {
-    enum diskop op = DREAD;
-    if (b->flags & B_DIRTY)
-        op = DWRITE;
-    
-    init_sem(&b->sem, 0);
-
-    u64 sector = b->block_no;
-    struct virtio_blk_req_hdr hdr;
+    while (disk.virtq.nfree < n) {
+        _lock_sem(&disk.desc_sem);
+        release_spinlock(&disk.lk);
+        ASSERT(_wait_sem(&disk.desc_sem, false));
+        acquire_spinlock(&disk.lk);
+    }
+}
 
-    if (op == DREAD)
-        hdr.type = VIRTIO_BLK_T_IN;
-    else if (op == DWRITE)
-        hdr.type = VIRTIO_BLK_T_OUT;
-    else
+int virtio_blk_rwv(u32 block_no, u8 **bufs, int n, bool write)
+{
+    if (n <= 0 || n > VIRTIO_MAX_SEGS)
         return -1;
+
+    Semaphore sem;
+    init_sem(&sem, 0);
+
+    struct virtio_blk_req_hdr hdr;
+    hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
     hdr.reserved = 0;
-    hdr.sector = sector;
+    hdr.sector = block_no;
 
     acquire_spinlock(&disk.lk);
+    // one chain of the header, the `n` buffers and the status.
+    wait_for_desc(n + 2);
 
     int d0 = alloc_desc(&disk.virtq);
-    if (d0 < 0)
-        return -1;
     disk.virtq.desc[d0].addr = (u64)V2P(&hdr);
     disk.virtq.desc[d0].len = sizeof(hdr);
     disk.virtq.desc[d0].flags = VIRTQ_DESC_F_NEXT;
 
-    int d1 = alloc_desc(&disk.virtq);
-    if (d1 < 0)
-        return -1;
-    disk.virtq.desc[d0].next = d1;
-    disk.virtq.desc[d1].addr = (u64)V2P(b->data);
-    disk.virtq.desc[d1].len = 512;
-    disk.virtq.desc[d1].flags = VIRTQ_DESC_F_NEXT;
-    if (op == DREAD)
-        disk.virtq.desc[d1].flags |= VIRTQ_DESC_F_WRITE;
-
-    int d2 = alloc_desc(&disk.virtq);
-    if (d2 < 0)
-        return -1;
-    disk.virtq.desc[d1].next = d2;
-    disk.virtq.desc[d2].addr = (u64)V2P(&disk.virtq.info[d0].status);
-    disk.virtq.desc[d2].len = sizeof(disk.virtq.info[d0].status);
-    disk.virtq.desc[d2].flags = VIRTQ_DESC_F_WRITE;
-    disk.virtq.desc[d2].next = 0;
+    int prev = d0;
+    for (int i = 0; i < n; i++) {
+        int d = alloc_desc(&disk.virtq);
+        disk.virtq.desc[prev].next = d;
+        disk.virtq.desc[d].addr = (u64)V2P(bufs[i]);
+        disk.virtq.desc[d].len = BSIZE;
+        disk.virtq.desc[d].flags = VIRTQ_DESC_F_NEXT;
+        if (!write)
+            disk.virtq.desc[d].flags |= VIRTQ_DESC_F_WRITE;
+        prev = d;
+    }
+
+    int dn = alloc_desc(&disk.virtq);
+    disk.virtq.desc[prev].next = dn;
+    disk.virtq.desc[dn].addr = (u64)V2P(&disk.virtq.info[d0].status);
+    disk.virtq.desc[dn].len = sizeof(disk.virtq.info[d0].status);
+    disk.virtq.desc[dn].flags = VIRTQ_DESC_F_WRITE;
+    disk.virtq.desc[dn].next = 0;
 
     disk.virtq.avail->ring[disk.virtq.avail->idx % NQUEUE] = d0;
     disk.virtq.avail->idx++;
 
-    disk.virtq.info[d0].buf = b->data;
+    disk.virtq.info[d0].sem = &sem;
 
     arch_fence();
     REG(VIRTIO_REG_QUEUE_NOTIFY) = 0;
@@ -116,21 +121,35 @@ int virtio_blk_rw(Buf *b)
 
     while (!disk.virtq.info[d0].done) {
         release_spinlock(&disk.lk);
-        if (!wait_sem(&b->sem)) {
+        if (!wait_sem(&sem)) {
             printk("[Virtio]: Disk operation failed.");
             PANIC();  // return -1;
         }
         // Semaphores needn't check the condition again, so 'while' is not needed here.
-        ASSERT(b->flags & B_VALID);
         acquire_spinlock(&disk.lk);
     }
 
     disk.virtq.info[d0].done = 0;
     free_desc(&disk.virtq, d0);
+    post_all_sem(&disk.desc_sem);
     release_spinlock(&disk.lk);
     return 0;
 }
 
+int virtio_blk_rw(Buf *b)
+{
+    u8 *data = b->data;
+    if (virtio_blk_rwv(b->block_no, &data, 1, b->flags & B_DIRTY) != 0)
+        return -1;
+    /**
+     * If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+     * Else if B_VALID is not set, read buf from disk, set B_VALID.
+     */
+    b->flags &= ~B_DIRTY;
+    b->flags |= B_VALID;
+    return 0;
+}
+
 static void virtio_blk_intr()
 {
     acquire_spinlock(&disk.lk);
@@ -145,21 +164,10 @@ static void virtio_blk_intr()
             PANIC();
         }
 
-        Buf* b = container_of(disk.virtq.info[d0].buf, Buf, data[0]);
-        // Buf* b = (Buf*)((char*)disk.virtq.info[d0].buf - offset_of(Buf, data));
-        
-        /**
-         * If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-         * Else if B_VALID is not set, read buf from disk, set B_VALID.
-         */
-        if(b->flags & B_DIRTY)
-            b->flags &= ~B_DIRTY;
-        b->flags |= B_VALID;
-
         disk.virtq.info[d0].done = 1;
-        post_sem(&b->sem);
+        post_sem(disk.virtq.info[d0].sem);
 
-        disk.virtq.info[d0].buf = NULL;
+        disk.virtq.info[d0].sem = NULL;
         disk.virtq.last_used_idx++;
     }
 
@@ -268,4 +276,5 @@ void virtio_init()
 
     set_interrupt_handler(VIRTIO_BLK_IRQ, virtio_blk_intr);
     init_spinlock(&disk.lk);
+    init_sem(&disk.desc_sem, 0);
 }
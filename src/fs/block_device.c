@@ -31,6 +31,25 @@ static void sd_write(usize block_no, u8 *buffer) {
     virtio_blk_rw(&b);
 }
 
+/**
+    @brief read / write consecutive blocks in requests of at most
+    `VIRTIO_MAX_SEGS` blocks each.
+ */
+static void sd_rwv(usize block_no, u8 **buffers, usize n, bool write) {
+    for (usize i = 0; i < n; i += VIRTIO_MAX_SEGS) {
+        int cnt = (int)MIN(n - i, (usize)VIRTIO_MAX_SEGS);
+        virtio_blk_rwv((u32)(block_no + i) + BLOCKNO_OFFSET, buffers + i, cnt, write);
+    }
+}
+
+static void sd_readv(usize block_no, u8 **buffers, usize n) {
+    sd_rwv(block_no, buffers, n, false);
+}
+
+static void sd_writev(usize block_no, u8 **buffers, usize n) {
+    sd_rwv(block_no, buffers, n, true);
+}
+
 /**
     @brief the in-memory copy of the super block.
 
@@ -54,6 +73,8 @@ BlockDevice block_device;
 void init_block_device() {
     block_device.read = sd_read;
     block_device.write = sd_write;
+    block_device.readv = sd_readv;
+    block_device.writev = sd_writev;
 
     // static __attribute__((unused)) void probe();
     // probe();
@@ -29,6 +29,26 @@ typedef struct {
         @param[in] buffer the buffer to write from.
      */
     void (*write)(usize block_no, u8 *buffer);
+
+    /**
+        read `n` consecutive blocks from `block_no`, the i-th one to
+        `buffers[i]`, in as few requests as the device allows.
+
+        @param[in] block_no the first block number to read from.
+        @param[out] buffers the buffers to read into.
+        @param[in] n the number of blocks.
+     */
+    void (*readv)(usize block_no, u8 **buffers, usize n);
+
+    /**
+        write `n` consecutive blocks from `block_no`, the i-th one from
+        `buffers[i]`, in as few requests as the device allows.
+
+        @param[in] block_no the first block number to write to.
+        @param[in] buffers the buffers to write from.
+        @param[in] n the number of blocks.
+     */
+    void (*writev)(usize block_no, u8 **buffers, usize n);
 } BlockDevice;
 
 /**
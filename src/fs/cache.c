@@ -1,4 +1,5 @@
 #include <common/bitmap.h>
+#include <common/crc32c.h>
 #include <common/string.h>
 #include <fs/cache.h>
 #include <kernel/mem.h>
@@ -8,19 +9,182 @@
 static const SuperBlock *sblock;
 static const BlockDevice *device;
 
-static SpinLock lock;     // protects block cache.
-static ListNode head;     // the list of all allocated in-memory block.
-static LogHeader header;  // in-memory copy of log header block.
-static usize cache_cnt;
+/*
+ * Cached blocks are found through a hash table on `block_no`, each bucket
+ * with its own lock, so lookups of different blocks do not contend. The
+ * replacement lists have a lock of their own.
+ *
+ * Locking order: `lru_lock`, then a bucket lock, then `pool_lock`.
+ */
+#define NUM_BUCKETS 1021
 
+static struct {
+    SpinLock lock;
+    ListNode head;
+} buckets[NUM_BUCKETS];
+
+#define bucket_of(block_no) (&buckets[(block_no) % NUM_BUCKETS])
+
+/*
+ * With CACHE_LRU all blocks are in `head`. With CACHE_2Q a block read for
+ * the first time goes to the FIFO `a1in`, and is only moved to `head` (Am
+ * in 2Q) if it is read again soon after it is evicted from there, i.e.
+ * while its number is still in the ghost FIFO `a1out`. A sequential scan
+ * thus only flushes `a1in`.
+ */
+#define A1IN_SHARE 4   // 2Q evicts from `a1in` first while it is over 1/4 of the cache
+#define A1OUT_SHARE 2  // and remembers as many evicted blocks as 1/2 of the cache
+
+typedef struct {
+    ListNode node;       // in `a1out`
+    ListNode hash_node;  // in `ghosts`
+    usize block_no;
+} Ghost;
+
+static SpinLock lru_lock;  // protects the below, and `Block.node` and `Block.in_a1`.
+static ListNode head;      // most recently used first.
+static ListNode a1in;      // most recently read first.
+static ListNode a1out;     // most recently evicted first.
+static ListNode ghosts[NUM_BUCKETS];
+static usize cache_cnt, a1in_cnt, a1out_cnt;
+static usize max_cached;  // the eviction threshold, see `EVICTION_THRESHOLD`.
+static CachePolicy policy = CACHE_2Q;
+static CacheStat stats[NUM_CACHE_POLICIES];
+
+/*
+ * A commit appends the blocks of the running transaction to the log and
+ * writes the header, with a checksum to tell a torn commit at recovery, so
+ * that the two need no order: into an empty log both go in one request.
+ * Committed blocks stay pinned in the cache, and are only written to their
+ * home locations (checkpointed) from there when the log fills up or the
+ * commit thread is idle, so that a block changed by many transactions is
+ * written home once. A block can be in the log more than once, the last
+ * copy wins.
+ */
+static LogHeader header;                 // in-memory copy of log header block.
+static usize running[LOG_MAX_SIZE];      // blocks of the running transaction.
+static usize num_running;
+static u32 log_crc;                      // CRC32C of the logged blocks.
+
+/*
+ * In JOURNAL_ORDERED mode, the file data blocks of the running transaction
+ * are kept pinned in `ordered` instead, and written home before it commits.
+ * When it is full, more are logged.
+ */
+#define ORDERED_MAX_SIZE (4 * LOG_MAX_SIZE)
+
+static usize ordered[ORDERED_MAX_SIZE];
+static usize num_ordered;
+static JournalMode journal_mode = JOURNAL_ORDERED;
+
+/*
+ * The number of free blocks under each bitmap block, so that allocation
+ * skips the full ones without reading them. Changed by the holder of the
+ * bitmap block, read without it.
+ */
+static usize num_bitmap_blocks;
+static usize *free_blocks;
+static usize alloc_hint;  // where the next search without a goal starts.
+
+/*
+ * A block freed by the running transaction is not reused before it commits:
+ * an ordered write to it would land on the data of the file that still owns
+ * it after a crash. The first free under a bitmap block in a transaction
+ * keeps a copy of the block as committed, and allocation skips the blocks
+ * set in either. Their count goes to `free_blocks` at the commit. Protected
+ * by `log_lock`, and only emptied at a commit, when no operation is running.
+ */
+typedef struct {
+    usize bitmap_no;         // index of the bitmap block.
+    usize num_freed;         // blocks freed under it, that were set in `committed`.
+    BitmapCell *committed;
+} FrozenBitmap;
+
+static FrozenBitmap frozen[LOG_MAX_SIZE];  // each is in `running` too.
+static usize num_frozen;
+
+/*
+ * The log and checkpoint I/O go through `log_buf`, so that each pass is a
+ * few vectored requests and no two cached blocks are held at once. Only one
+ * commit or the recovery uses it at a time. `log_bufs` are the header
+ * blocks, then `log_buf`, as laid out on disk.
+ */
+static u8 log_buf[LOG_MAX_SIZE][BLOCK_SIZE];
+static u8 *log_bufs[LOG_HEADER_BLOCKS + LOG_MAX_SIZE];
+
+/*
+ * Blocks are carved from pages of their own, so that evicting them gives
+ * whole pages back to the page allocator (`kfree` never does).
+ */
+typedef struct {
+    ListNode node;  // in `partial_pages` while some of its blocks are free.
+    ListNode free;  // its free blocks, linked by `Block.node`.
+    usize used;
+} BlockPage;
+
+#define BLOCKS_PER_PAGE ((PAGE_SIZE - sizeof(BlockPage)) / sizeof(Block))
+
+static SpinLock pool_lock;  // protects `partial_pages` and the pages in it.
+static ListNode partial_pages;
+
+static Block *alloc_block() {
+    acquire_spinlock(&pool_lock);
+    BlockPage *page;
+    if (_empty_list(&partial_pages)) {
+        page = kalloc_page();
+        init_list_node(&page->free);
+        page->used = 0;
+        Block *blocks = (Block *)(page + 1);
+        for (usize i = 0; i < BLOCKS_PER_PAGE; i++)
+            _insert_into_list(&page->free, &blocks[i].node);
+        _insert_into_list(&partial_pages, &page->node);
+    } else {
+        page = container_of(partial_pages.next, BlockPage, node);
+    }
+    Block *block = container_of(page->free.next, Block, node);
+    _detach_from_list(&block->node);
+    if (++page->used == BLOCKS_PER_PAGE)
+        _detach_from_list(&page->node);
+    release_spinlock(&pool_lock);
+    return block;
+}
+
+// return true if the page of `block` is freed too.
+static bool free_block(Block *block) {
+    BlockPage *page = (BlockPage *)PAGE_BASE(block);
+    acquire_spinlock(&pool_lock);
+    if (page->used-- == BLOCKS_PER_PAGE)
+        _insert_into_list(&partial_pages, &page->node);
+    _insert_into_list(&page->free, &block->node);
+    bool empty = page->used == 0;
+    if (empty)
+        _detach_from_list(&page->node);
+    release_spinlock(&pool_lock);
+    if (empty)
+        kfree_page(page);
+    return empty;
+}
+
+/*
+ * All the operations begun since the last commit form the running
+ * transaction. It is closed (`closing`) when the log gets half full or
+ * someone waits for it, and then committed once its operations ended.
+ * Without a commit thread, the last `end_op` commits, see
+ * `set_bcache_committer`.
+ */
 struct {
     int max_size;
     int outstanding;
     int log_used;
+    bool closing;     // no new operation may join the running transaction.
     bool committing;
+    bool committer;   // a commit thread runs `bcache_commit`.
+    bool async;       // `end_op` does not wait for the commit.
+    usize tx;         // the ID of the running transaction. those before are durable.
     SpinLock log_lock;
     Semaphore log_sem;
     Semaphore log_commit_sem;
+    Semaphore commit_req_sem;  // wakes the commit thread.
 } log;
 
 // read the content from disk.
@@ -35,18 +199,26 @@ static INLINE void device_write(Block *block) {
 
 // read log header from disk.
 static INLINE void read_header() {
-    device->read(sblock->log_start, (u8 *)&header);
+    device->readv(sblock->log_start, log_bufs, LOG_HEADER_BLOCKS);
+}
+
+// the number of header blocks holding the first `n` block numbers.
+static INLINE usize header_blocks(usize n) {
+    return (offset_of(LogHeader, block_no) + n * sizeof(usize) + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
-// write log header back to disk.
+// write log header back to disk, as far as it is used.
 static INLINE void write_header() {
-    device->write(sblock->log_start, (u8 *)&header);
+    device->writev(sblock->log_start, log_bufs, header_blocks(header.num_blocks));
 }
 
 // initialize a block struct.
 static __attribute__((unused)) void init_block(Block *block) {
     block->block_no = 0;
     init_list_node(&block->node);
+    init_list_node(&block->hash_node);
+    block->refcnt = 0;
+    block->in_a1 = false;
     block->acquired = false;
     block->pinned = false;
 
@@ -60,150 +232,384 @@ static usize get_num_cached_blocks() {
     return cache_cnt;
 }
 
-// see `cache.h`.
-// caller should acquire lock of cache list
-void LRU_shrink() {
-    Block *cached_block = NULL;
-    ListNode *p = head.prev;
-    while (get_num_cached_blocks() >= EVICTION_THRESHOLD && p != &head) {
-        cached_block = container_of(p, Block, node);
-        if (!cached_block->pinned && !cached_block->acquired) {
-            p = _detach_from_list(p);
-            kfree(cached_block);
+// find and remove the ghost of `block_no`. caller should acquire `lru_lock`.
+static bool take_ghost(usize block_no) {
+    ListNode *h = &ghosts[block_no % NUM_BUCKETS];
+    for (ListNode *p = h->next; p != h; p = p->next) {
+        Ghost *g = container_of(p, Ghost, hash_node);
+        if (g->block_no == block_no) {
+            _detach_from_list(&g->hash_node);
+            _detach_from_list(&g->node);
+            a1out_cnt--;
+            kfree(g);
+            return true;
+        }
+    }
+    return false;
+}
+
+// remember that `block_no` left `a1in`. caller should acquire `lru_lock`.
+static void add_ghost(usize block_no) {
+    Ghost *g;
+    if (a1out_cnt >= max_cached / A1OUT_SHARE) {
+        if (a1out_cnt == 0)
+            return;
+        g = container_of(a1out.prev, Ghost, node);
+        _detach_from_list(&g->hash_node);
+        _detach_from_list(&g->node);
+    } else {
+        g = kalloc(sizeof(Ghost));
+        init_list_node(&g->node);
+        init_list_node(&g->hash_node);
+        a1out_cnt++;
+    }
+    g->block_no = block_no;
+    _merge_list(&ghosts[block_no % NUM_BUCKETS], &g->hash_node);
+    _merge_list(&a1out, &g->node);
+}
+
+// evict the last block of `list` nobody holds. return false if there is none.
+// caller should acquire `lru_lock`.
+static bool evict(ListNode *list, usize *freed) {
+    for (ListNode *p = list->prev; p != list; p = p->prev) {
+        Block *cached_block = container_of(p, Block, node);
+        SpinLock *bucket_lock = &bucket_of(cached_block->block_no)->lock;
+        acquire_spinlock(bucket_lock);
+        if (cached_block->refcnt == 0 && !cached_block->pinned) {
+            _detach_from_list(&cached_block->hash_node);
+            release_spinlock(bucket_lock);
+            _detach_from_list(p);
+            if (cached_block->in_a1) {
+                a1in_cnt--;
+                if (policy == CACHE_2Q)
+                    add_ghost(cached_block->block_no);
+            }
+            *freed += free_block(cached_block);
             --cache_cnt;
-        } else {
-            p = p->prev;
+            stats[policy].evictions++;
+            return true;
         }
+        release_spinlock(bucket_lock);
     }
+    return false;
 }
-Proc *thisproc();
-static Block *cache_acquire(usize block_no) {
-    bool if_back = false;
-__back:
-    acquire_spinlock(&lock);
-    // printk("A");
-    ListNode *p = head.next;
-    Block *cached_block = NULL;
-    bool hit = false;
-    while (p != &head) {
-        cached_block = container_of(p, Block, node);
-        if (cached_block->block_no == block_no) {
-            hit = true;
-            break;
+
+// evict blocks nobody holds until there are no more than `keep` or
+// `nr_pages` pages are freed. return the pages freed.
+// caller should acquire `lru_lock`.
+static usize LRU_shrink(usize keep, usize nr_pages) {
+    usize freed = 0;
+    while (get_num_cached_blocks() > keep && freed < nr_pages) {
+        ListNode *first = &head, *second = &a1in;
+        if (a1in_cnt > max_cached / A1IN_SHARE) {
+            first = &a1in;
+            second = &head;
         }
-        p = p->next;
+        if (!evict(first, &freed) && !evict(second, &freed))
+            break;
+    }
+    return freed;
+}
+
+// the shrinker of the block cache, see `register_shrinker`.
+static usize cache_shrink(usize nr_pages) {
+    acquire_spinlock(&lru_lock);
+    usize freed = LRU_shrink(0, nr_pages);
+    release_spinlock(&lru_lock);
+    return freed;
+}
+
+// see `cache.h`.
+void set_bcache_policy(CachePolicy new_policy) {
+    ASSERT(new_policy < NUM_CACHE_POLICIES);
+    acquire_spinlock(&lru_lock);
+    policy = new_policy;
+    release_spinlock(&lru_lock);
+}
+
+// see `cache.h`.
+void get_bcache_stat(CachePolicy which, CacheStat *stat) {
+    acquire_spinlock(&lru_lock);
+    *stat = stats[which];
+    release_spinlock(&lru_lock);
+}
+
+// find `block_no` in its bucket. caller should acquire the bucket lock.
+static Block *lookup(usize block_no) {
+    ListNode *h = &bucket_of(block_no)->head;
+    for (ListNode *p = h->next; p != h; p = p->next) {
+        Block *b = container_of(p, Block, hash_node);
+        if (b->block_no == block_no)
+            return b;
     }
-    if (hit) {
-        if (cached_block->acquired) {
-            release_spinlock(&lock);
-            unalertable_wait_sem(&(cached_block->lock));  //_acquire_sleeplock(&cached_block->lock);
-            if_back = true;
-            goto __back;  // ensure the cached_block is still there after sleep
+    return NULL;
+}
+
+static Block *cache_acquire(usize block_no) {
+    SpinLock *bucket_lock = &bucket_of(block_no)->lock;
+    acquire_spinlock(bucket_lock);
+    Block *cached_block = lookup(block_no);
+    if (cached_block) {
+        // the reference keeps it cached while we sleep.
+        cached_block->refcnt++;
+        release_spinlock(bucket_lock);
+        unalertable_acquire_sleeplock(&cached_block->lock);
+
+        acquire_spinlock(&lru_lock);
+        stats[policy].hits++;
+        // 2Q leaves a block read once in `a1in` until it is evicted.
+        if (!cached_block->in_a1 || policy != CACHE_2Q) {
+            if (cached_block->in_a1)
+                a1in_cnt--;
+            cached_block->in_a1 = false;
+            _detach_from_list(&cached_block->node);
+            _merge_list(&head, &cached_block->node);
         }
-        _detach_from_list(p);
-        _merge_list(&head, p);  // for LRU
+        release_spinlock(&lru_lock);
     } else {
-        if (get_num_cached_blocks() >= EVICTION_THRESHOLD) {
-            LRU_shrink();
-        }
-        cached_block = (Block *)kalloc(sizeof(Block));
-        ++cache_cnt;
+        cached_block = alloc_block();
         init_block(cached_block);
         cached_block->block_no = block_no;
-        release_spinlock(&lock);
+        cached_block->refcnt = 1;
+        // nobody else has it yet. others find it locked until it is read.
+        ASSERT(get_sem(&cached_block->lock));
+        _merge_list(&bucket_of(block_no)->head, &cached_block->hash_node);
+        release_spinlock(bucket_lock);
+
+        acquire_spinlock(&lru_lock);
+        stats[policy].misses++;
+        if (get_num_cached_blocks() >= max_cached)
+            LRU_shrink(max_cached - 1, (usize)-1);
+        if (policy == CACHE_2Q && !take_ghost(block_no)) {
+            cached_block->in_a1 = true;
+            a1in_cnt++;
+            _merge_list(&a1in, &cached_block->node);
+        } else {
+            _merge_list(&head, &cached_block->node);
+        }
+        ++cache_cnt;
+        release_spinlock(&lru_lock);
+
         device_read(cached_block);
-        acquire_spinlock(&lock);
         cached_block->valid = true;
-        _merge_list(&head, &(cached_block->node));  // for LRU
-    }
-    if (!hit || !if_back) {  // this lock can certainly get without wait
-        get_sem(&(cached_block->lock));
     }
     cached_block->acquired = true;
-    release_spinlock(&lock);
     return cached_block;
 }
 
 // see `cache.h`.
 static void cache_release(Block *block) {
-    acquire_spinlock(&lock);
+    SpinLock *bucket_lock = &bucket_of(block->block_no)->lock;
     block->acquired = false;
-    post_sem(&(block->lock));
-    release_spinlock(&lock);
+    release_sleeplock(&block->lock);
+    acquire_spinlock(bucket_lock);
+    block->refcnt--;
+    release_spinlock(bucket_lock);
 }
 
+// write `log_buf[0..n)` to blocks `block_no[0..n)` in order, one request for
+// each run of consecutive block numbers.
+static void write_home(const usize *block_no, usize n) {
+    for (usize i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && block_no[j] == block_no[j - 1] + 1; j++)
+            ;
+        device->writev(block_no[i], log_bufs + LOG_HEADER_BLOCKS + i, j - i);
+    }
+}
+
+// the checksum of the log with `n` blocks, whose CRC32C is `crc`.
+static INLINE u32 log_checksum(u32 crc, usize n) {
+    return crc32c(crc, header.block_no, n * sizeof(usize));
+}
+
+static void clear_log() {
+    header.num_blocks = header.prev_blocks = 0;
+    header.checksum = header.prev_checksum = 0;
+    log_crc = 0;
+    write_header();
+}
+
+// replay the log up to the last commit whose blocks all made it to disk.
 void recover_from_log() {
     read_header();
-    for (usize i = 0; i < header.num_blocks; ++i) {
-        Block temp;
-        temp.block_no = sblock->log_start + i + 1;
-        device_read(&temp);
-        temp.block_no = header.block_no[i];
-        // ASSERT(temp.block_no < sblock->num_blocks);
-        device_write(&temp);
+    usize n = header.num_blocks, good = 0;
+    if (n > 0 && n <= (usize)log.max_size && header.prev_blocks < n) {
+        device->readv(sblock->log_start + LOG_HEADER_BLOCKS, log_bufs + LOG_HEADER_BLOCKS, n);
+        u32 crc = 0;
+        for (usize i = 0; i < n; i++) {
+            crc = crc32c(crc, log_buf[i], BLOCK_SIZE);
+            if (i + 1 == header.prev_blocks && log_checksum(crc, i + 1) == header.prev_checksum)
+                good = i + 1;
+        }
+        if (log_checksum(crc, n) == header.checksum)
+            good = n;
+        write_home(header.block_no, good);
     }
-    header.num_blocks = 0;
-    write_header();
+    clear_log();
+}
+// let the blocks freed by the committed transaction be reused.
+static void thaw_bitmaps() {
+    for (usize i = 0; i < num_frozen; i++) {
+        __atomic_fetch_add(&free_blocks[frozen[i].bitmap_no], frozen[i].num_freed,
+                           __ATOMIC_RELAXED);
+        kfree(frozen[i].committed);
+    }
+    num_frozen = 0;
+}
+
+// the committed copy of the `b`-th bitmap block, if the running transaction
+// freed blocks under it. caller should acquire `log_lock`.
+static FrozenBitmap *find_frozen(usize b) {
+    for (usize i = 0; i < num_frozen; i++) {
+        if (frozen[i].bitmap_no == b)
+            return &frozen[i];
+    }
+    return NULL;
+}
+
+// count the free blocks of each bitmap block.
+static void init_alloc() {
+    for (usize i = 0; i < num_frozen; i++)
+        kfree(frozen[i].committed);
+    num_frozen = 0;
+    num_bitmap_blocks = (sblock->num_blocks + BIT_PER_BLOCK - 1) / BIT_PER_BLOCK;
+    if (free_blocks)
+        kfree(free_blocks);
+    free_blocks = kalloc(num_bitmap_blocks * sizeof(usize));
+    for (usize b = 0; b < num_bitmap_blocks; b++) {
+        usize size = MIN((usize)BIT_PER_BLOCK, sblock->num_blocks - b * BIT_PER_BLOCK);
+        Block *bitmap_block = cache_acquire(sblock->bitmap_start + b);
+        free_blocks[b] = size - bitmap_count((BitmapCell *)bitmap_block->data, size);
+        cache_release(bitmap_block);
+    }
+    alloc_hint = 0;
 }
+
 // initialize block cache.
 void init_bcache(const SuperBlock *_sblock, const BlockDevice *_device) {
     sblock = _sblock;
     device = _device;
 
-    init_spinlock(&lock);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        init_spinlock(&buckets[i].lock);
+        init_list_node(&buckets[i].head);
+    }
+    for (usize i = 0; i < LOG_HEADER_BLOCKS; i++)
+        log_bufs[i] = (u8 *)&header + i * BLOCK_SIZE;
+    for (usize i = 0; i < LOG_MAX_SIZE; i++)
+        log_bufs[LOG_HEADER_BLOCKS + i] = log_buf[i];
+    init_spinlock(&lru_lock);
+    init_spinlock(&pool_lock);
     init_spinlock(&(log.log_lock));
     init_list_node(&head);
-    cache_cnt = 0;
+    init_list_node(&a1in);
+    init_list_node(&a1out);
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        init_list_node(&ghosts[i]);
+    init_list_node(&partial_pages);
+    cache_cnt = a1in_cnt = a1out_cnt = 0;
+    memset(stats, 0, sizeof(stats));
+    max_cached = MAX((usize)EVICTION_THRESHOLD, left_page_cnt() / BCACHE_MEM_SHARE * BLOCKS_PER_PAGE);
+    register_shrinker(cache_shrink);
     init_sem(&(log.log_sem), 0);
     init_sem(&(log.log_commit_sem), 0);
-    log.max_size = MIN(sblock->num_log_blocks - 1, LOG_MAX_SIZE);
+    init_sem(&(log.commit_req_sem), 0);
+    log.max_size = MIN(sblock->num_log_blocks - LOG_HEADER_BLOCKS, LOG_MAX_SIZE);
     log.log_used = 0;
+    log.closing = false;
     log.committing = false;
+    log.committer = false;
+    log.async = false;
+    log.tx = 0;
     log.outstanding = 0;
+    num_ordered = 0;
     recover_from_log();
+    init_alloc();
+}
+
+// stop the running transaction from growing, and let the commit thread
+// commit it once its operations ended. caller should acquire `log_lock`.
+static void close_transaction() {
+    if (num_running + num_ordered + header.num_blocks + log.outstanding == 0)
+        return;
+    log.closing = true;
+    if (log.outstanding == 0)
+        post_sem(&log.commit_req_sem);
+}
+
+// sleep until transaction `tx` is durable. caller should acquire `log_lock`.
+static void wait_for_commit(usize tx) {
+    while (log.tx == tx) {
+        _lock_sem(&(log.log_commit_sem));
+        release_spinlock(&(log.log_lock));
+        ASSERT(_wait_sem(&(log.log_commit_sem), false));
+        acquire_spinlock(&(log.log_lock));
+    }
 }
 
 // see `cache.h`.
-static void cache_begin_op(OpContext *ctx) {
+static usize cache_begin_sized_op(OpContext *ctx, usize num_blocks) {
     acquire_spinlock(&(log.log_lock));
+    // no more than half the log, so that two of them fit in.
+    num_blocks = MIN(num_blocks, MAX((usize)OP_MAX_NUM_BLOCKS, (usize)log.max_size / 2));
     while (true) {
-        if (log.committing) {
+        if (log.committing || log.closing) {
             _lock_sem(&(log.log_sem));
             release_spinlock(&(log.log_lock));
             ASSERT(_wait_sem(&(log.log_sem), false));
             acquire_spinlock(&(log.log_lock));
-        } else if (log.log_used + (int)header.num_blocks + OP_MAX_NUM_BLOCKS > log.max_size) {
+        } else if (log.log_used + (int)(header.num_blocks + num_running + num_blocks) >
+                   log.max_size) {
+            if (log.committer)
+                close_transaction();
             _lock_sem(&(log.log_sem));
             release_spinlock(&(log.log_lock));
             ASSERT(_wait_sem(&(log.log_sem), false));
             acquire_spinlock(&(log.log_lock));
         } else {
             log.outstanding++;
-            log.log_used += OP_MAX_NUM_BLOCKS;
-            ctx->rm = OP_MAX_NUM_BLOCKS;
+            log.log_used += num_blocks;
+            ctx->rm = num_blocks;
             break;
         }
     }
     release_spinlock(&(log.log_lock));
+    return num_blocks;
+}
+
+// see `cache.h`.
+static void cache_begin_op(OpContext *ctx) {
+    cache_begin_sized_op(ctx, OP_MAX_NUM_BLOCKS);
+}
+
+// the index of `block_no` in `list[0..n)`, or `n` if it is not there.
+static usize find_block(const usize *list, usize n, usize block_no) {
+    usize i = 0;
+    while (i < n && list[i] != block_no)
+        i++;
+    return i;
+}
+
+// remove the `i`-th of `list[0..*n)`.
+static void remove_block(usize *list, usize *n, usize i) {
+    memmove(list + i, list + i + 1, (--*n - i) * sizeof(usize));
 }
 
 // see `cache.h`.
 static void cache_sync(OpContext *ctx, Block *block) {
     if (ctx) {
         acquire_spinlock(&(log.log_lock));
-        usize i;
-        for (i = 0; i < header.num_blocks; ++i) {
-            if (header.block_no[i] == block->block_no) {
-                break;
-            }
-        }
-        if (i == header.num_blocks) {
-            header.block_no[i] = block->block_no;
+        usize i = find_block(ordered, num_ordered, block->block_no);
+        if (i < num_ordered)  // reused for metadata
+            remove_block(ordered, &num_ordered, i);
+        i = find_block(running, num_running, block->block_no);
+        if (i == num_running) {
+            running[i] = block->block_no;
             block->pinned = true;
             if (ctx->rm > 0) {
                 ctx->rm--;
                 log.log_used--;
-                header.num_blocks++;
+                num_running++;
             } else {
                 PANIC();
             }
@@ -215,101 +621,279 @@ static void cache_sync(OpContext *ctx, Block *block) {
     }
 }
 
+// see `cache.h`.
+static void cache_sync_data(OpContext *ctx, Block *block) {
+    if (!ctx) {
+        cache_sync(ctx, block);
+        return;
+    }
+    acquire_spinlock(&(log.log_lock));
+    usize block_no = block->block_no;
+    if (journal_mode == JOURNAL_DATA || num_ordered == ORDERED_MAX_SIZE ||
+        find_block(header.block_no, header.num_blocks, block_no) < header.num_blocks) {
+        release_spinlock(&(log.log_lock));
+        cache_sync(ctx, block);
+        return;
+    }
+    if (find_block(ordered, num_ordered, block_no) == num_ordered) {
+        // e.g. zeroed by `alloc`: not logged after all.
+        usize i = find_block(running, num_running, block_no);
+        if (i < num_running) {
+            remove_block(running, &num_running, i);
+            ctx->rm++;
+            log.log_used++;
+        }
+        ordered[num_ordered++] = block_no;
+        block->pinned = true;
+    }
+    release_spinlock(&(log.log_lock));
+}
+
+// append the running transaction to the log, and commit it.
 void write_block_to_log() {
-    for (usize i = 0; i < header.num_blocks; ++i) {
-        Block *b_op = cache_acquire(header.block_no[i]);
-        // ASSERT(sblock->log_start + 1 + i < sblock->num_blocks);
-        device->write(sblock->log_start + 1 + i, b_op->data);
-        b_op->pinned = false;
+    if (num_running == 0)
+        return;
+    usize start = header.num_blocks;
+    for (usize i = 0; i < num_running; ++i) {
+        Block *b_op = cache_acquire(running[i]);
+        memcpy(log_buf[i], b_op->data, BLOCK_SIZE);
         cache_release(b_op);
+        log_crc = crc32c(log_crc, log_buf[i], BLOCK_SIZE);
+        header.block_no[start + i] = running[i];
     }
+    header.prev_blocks = start;
+    header.prev_checksum = header.checksum;
+    header.num_blocks += num_running;
+    header.checksum = log_checksum(log_crc, header.num_blocks);
+    // ASSERT(sblock->log_start + LOG_HEADER_BLOCKS + header.num_blocks <= sblock->num_blocks);
+    if (start == 0)
+        device->writev(sblock->log_start, log_bufs, LOG_HEADER_BLOCKS + num_running);
+    else {
+        device->writev(sblock->log_start + LOG_HEADER_BLOCKS + start, log_bufs + LOG_HEADER_BLOCKS,
+                       num_running);
+        write_header();
+    }
+    num_running = 0;
 }
-void persist_from_log() {
-    u8 data[BLOCK_SIZE];
-    for (usize i = 0; i < header.num_blocks; ++i) {
-        device->read(sblock->log_start + 1 + i, data);
-        Block *b_op = cache_acquire(header.block_no[i]);
-        memmove(&(b_op->data), &data, BLOCK_SIZE);
-        // ASSERT(b_op->block_no < sblock->num_blocks);
-        device_write(b_op);
-        cache_release(b_op);
+// write the pinned blocks among `block_no[0..n)` home from the cache in block
+// order, and unpin them. They stay pinned until written, or they might be
+// read back stale.
+static void write_pinned_home(const usize *block_no, usize n) {
+    static usize sorted[ORDERED_MAX_SIZE], written[LOG_MAX_SIZE];
+    usize cnt = 0;
+    for (usize i = 0; i < n; ++i) {
+        usize j = 0;
+        while (j < cnt && sorted[j] < block_no[i])
+            j++;
+        if (j < cnt && sorted[j] == block_no[i])  // in the log more than once
+            continue;
+        memmove(sorted + j + 1, sorted + j, (cnt - j) * sizeof(usize));
+        sorted[j] = block_no[i];
+        cnt++;
     }
+
+    for (usize i = 0; i < cnt;) {
+        usize m = 0;
+        for (; i < cnt && m < LOG_MAX_SIZE; ++i) {
+            Block *b_op = cache_acquire(sorted[i]);
+            if (b_op->pinned) {  // not written by an earlier copy
+                memcpy(log_buf[m], b_op->data, BLOCK_SIZE);
+                written[m++] = sorted[i];
+            }
+            cache_release(b_op);
+        }
+        write_home(written, m);
+        for (usize j = 0; j < m; ++j) {
+            Block *b_op = cache_acquire(written[j]);
+            b_op->pinned = false;
+            cache_release(b_op);
+        }
+    }
+}
+
+// write the file data of the running transaction home.
+static void write_ordered() {
+    write_pinned_home(ordered, num_ordered);
+    num_ordered = 0;
 }
+
+// write the committed blocks home from the cache, and empty the log.
 void checkpoint() {
     if (header.num_blocks <= 0) {
         return;
     }
-    // Write blocks to log area
+    write_pinned_home(header.block_no, header.num_blocks);
+    clear_log();
+}
+// commit the running transaction, whose operations all ended. Checkpoint
+// too without a commit thread, when idle, or if the next transaction might
+// not fit. caller should acquire `log_lock`, which is released during the I/O.
+static void commit() {
+    ASSERT(log.outstanding == 0);
+    bool idle = num_running + num_ordered == 0;
+    log.committing = true;
+    release_spinlock(&(log.log_lock));
+    write_ordered();
     write_block_to_log();
-    write_header();
-    // actual write, Copy blocks to original locations
-    persist_from_log();
-    header.num_blocks = 0;
-    write_header();
+    thaw_bitmaps();
+    if (!log.committer || idle || (int)header.num_blocks * 2 + OP_MAX_NUM_BLOCKS > log.max_size)
+        checkpoint();
+    acquire_spinlock(&(log.log_lock));
+    log.committing = false;
+    log.closing = false;
+    log.tx++;
+    post_all_sem(&(log.log_commit_sem));
+    post_all_sem(&(log.log_sem));
 }
+
 // see `cache.h`.
 static void cache_end_op(OpContext *ctx) {
     acquire_spinlock(&(log.log_lock));
     log.outstanding--;
     log.log_used -= ctx->rm;
+    usize tx = log.tx;
 
-    if (log.outstanding == 0) {
-        log.committing = true;
-        release_spinlock(&(log.log_lock));
-        checkpoint();
-        log.committing = false;
-        post_all_sem(&(log.log_commit_sem));
-        post_all_sem(&(log.log_sem));
+    if (!log.committer) {
+        if (log.outstanding == 0)
+            commit();
+        else {
+            post_all_sem(&(log.log_sem));
+            wait_for_commit(tx);
+        }
     } else {
         post_all_sem(&(log.log_sem));
-        _lock_sem(&(log.log_commit_sem));
-        release_spinlock(&(log.log_lock));
-        ASSERT(_wait_sem(&(log.log_commit_sem), false));
+        if (!log.async || log.closing || (int)(header.num_blocks + num_running) * 2 >= log.max_size ||
+            num_ordered * 2 >= ORDERED_MAX_SIZE)
+            close_transaction();
+        if (!log.async)
+            wait_for_commit(tx);
     }
+    release_spinlock(&(log.log_lock));
 }
 
 // see `cache.h`.
-// hint: you can use `cache_acquire`/`cache_sync` to read/write blocks.
-static usize cache_alloc(OpContext *ctx) {
-    Block *bitmap_block = NULL;
-    for (usize index = 0; index < sblock->num_blocks; index += BIT_PER_BLOCK) {
-        usize bitmap_block_no = index / BIT_PER_BLOCK + sblock->bitmap_start;
-        bitmap_block = cache_acquire(bitmap_block_no);
+static void cache_flush() {
+    acquire_spinlock(&(log.log_lock));
+    if (log.committer && num_running + num_ordered + log.outstanding > 0) {
+        usize tx = log.tx;
+        close_transaction();
+        wait_for_commit(tx);
+    }
+    release_spinlock(&(log.log_lock));
+}
+
+// see `cache.h`.
+void set_bcache_committer(bool async) {
+    acquire_spinlock(&(log.log_lock));
+    log.committer = true;
+    log.async = async;
+    release_spinlock(&(log.log_lock));
+}
+
+// see `cache.h`.
+void set_bcache_journal_mode(JournalMode mode) {
+    acquire_spinlock(&(log.log_lock));
+    journal_mode = mode;
+    release_spinlock(&(log.log_lock));
+}
+
+// see `cache.h`.
+void bcache_kick_commit() {
+    post_sem(&log.commit_req_sem);
+}
+
+// see `cache.h`.
+void bcache_commit() {
+    unalertable_wait_sem(&log.commit_req_sem);
+    acquire_spinlock(&(log.log_lock));
+    if (num_running + num_ordered + header.num_blocks + log.outstanding > 0)
+        log.closing = true;
+    // otherwise the last operation to end kicks us again.
+    if (log.closing && log.outstanding == 0 && !log.committing)
+        commit();
+    release_spinlock(&(log.log_lock));
+}
+
+/*
+ * Search from `goal` (or where the last search ended) to the end, and then
+ * from the start, skipping bitmap blocks without free blocks.
+ */
+static usize cache_alloc_near(OpContext *ctx, usize goal) {
+    if (goal == 0 || goal >= sblock->num_blocks)
+        goal = __atomic_load_n(&alloc_hint, __ATOMIC_RELAXED);
+    if (goal >= sblock->num_blocks)
+        goal = 0;
+    for (usize k = 0; k <= num_bitmap_blocks; ++k) {
+        usize b = (goal / BIT_PER_BLOCK + k) % num_bitmap_blocks;
+        if (__atomic_load_n(&free_blocks[b], __ATOMIC_RELAXED) == 0)
+            continue;
+        usize base = b * BIT_PER_BLOCK;
+        usize size = MIN((usize)BIT_PER_BLOCK, sblock->num_blocks - base);
+        Block *bitmap_block = cache_acquire(sblock->bitmap_start + b);
         BitmapCell *bitmap = (BitmapCell *)(bitmap_block->data);
-        for (int i = 0; i < BIT_PER_BLOCK && index + i < sblock->num_blocks; ++i) {
-            bool if_valid = bitmap_get(bitmap, i);
-            if (if_valid == 0) {
-                bitmap_set(bitmap, i);
-                cache_sync(ctx, bitmap_block);
-                cache_release(bitmap_block);
-                usize alloc_block_no = index + i;
-                Block *alloc_block = cache_acquire(alloc_block_no);
-                memset(alloc_block->data, 0, BLOCK_SIZE);
-                cache_sync(ctx, alloc_block);
-                cache_release(alloc_block);
-                return alloc_block_no;
-            }
+        acquire_spinlock(&(log.log_lock));
+        FrozenBitmap *f = find_frozen(b);
+        release_spinlock(&(log.log_lock));
+        usize i = bitmap_find_zero(bitmap, k == 0 ? goal % BIT_PER_BLOCK : 0, size);
+        while (f && i < size && bitmap_get(f->committed, i))  // freed, not committed yet
+            i = bitmap_find_zero(bitmap, i + 1, size);
+        if (i == size) {
+            cache_release(bitmap_block);
+            continue;
         }
+        bitmap_set(bitmap, i);
+        cache_sync(ctx, bitmap_block);
+        __atomic_fetch_sub(&free_blocks[b], 1, __ATOMIC_RELAXED);
         cache_release(bitmap_block);
+        usize alloc_block_no = base + i;
+        __atomic_store_n(&alloc_hint, alloc_block_no + 1, __ATOMIC_RELAXED);
+        Block *alloc_block = cache_acquire(alloc_block_no);
+        memset(alloc_block->data, 0, BLOCK_SIZE);
+        cache_sync(ctx, alloc_block);
+        cache_release(alloc_block);
+        return alloc_block_no;
     }
     printk("[cache_alloc] No free block on disk\n");
     PANIC();
     return -1;
 }
 
+// see `cache.h`.
+static usize cache_alloc(OpContext *ctx) {
+    return cache_alloc_near(ctx, 0);
+}
+
 // see `cache.h`.
 // hint: you can use `cache_acquire`/`cache_sync` to read/write blocks.
 static void cache_free(OpContext *ctx, usize block_no) {
-    usize bitmap_block_no = block_no / BIT_PER_BLOCK + sblock->bitmap_start;
-    Block *bitmap_block = cache_acquire(bitmap_block_no);
+    usize b = block_no / BIT_PER_BLOCK;
+    Block *bitmap_block = cache_acquire(sblock->bitmap_start + b);
     BitmapCell *bitmap = (BitmapCell *)(bitmap_block->data);
     usize index = block_no % BIT_PER_BLOCK;
     bool if_valid = bitmap_get(bitmap, index);
     if (if_valid == false) {
         PANIC();
     }
+    acquire_spinlock(&(log.log_lock));
+    FrozenBitmap *f = find_frozen(b);
+    release_spinlock(&(log.log_lock));
+    if (!f) {  // no one else frees under it while we hold it.
+        BitmapCell *committed = kalloc(BLOCK_SIZE);
+        memcpy(committed, bitmap, BLOCK_SIZE);
+        acquire_spinlock(&(log.log_lock));
+        ASSERT(num_frozen < LOG_MAX_SIZE);
+        f = &frozen[num_frozen++];
+        f->bitmap_no = b;
+        f->num_freed = 0;
+        f->committed = committed;
+        release_spinlock(&(log.log_lock));
+    }
     bitmap_clear(bitmap, index);
     cache_sync(ctx, bitmap_block);
+    if (bitmap_get(f->committed, index))
+        f->num_freed++;
+    else  // allocated by this transaction too: reusable right away.
+        __atomic_fetch_add(&free_blocks[b], 1, __ATOMIC_RELAXED);
     cache_release(bitmap_block);
 }
 
@@ -318,8 +902,12 @@ BlockCache bcache = {
     .acquire = cache_acquire,
     .release = cache_release,
     .begin_op = cache_begin_op,
+    .begin_sized_op = cache_begin_sized_op,
     .sync = cache_sync,
+    .sync_data = cache_sync_data,
     .end_op = cache_end_op,
+    .flush = cache_flush,
     .alloc = cache_alloc,
+    .alloc_near = cache_alloc_near,
     .free = cache_free,
 };
@@ -10,12 +10,66 @@
 #define OP_MAX_NUM_BLOCKS 10
 
 /**
-    @brief the threshold of block cache to start eviction.
+    @brief the least threshold of block cache to start eviction.
 
-    if the number of cached blocks is no less than this threshold, we can
-    evict some blocks in `acquire` to keep block cache small.
+    The threshold is sized from free memory when the cache is initialized:
+    the cache may take up to 1 / BCACHE_MEM_SHARE of it, but no less than
+    EVICTION_THRESHOLD blocks. If the number of cached blocks is no less
+    than the threshold, `acquire` evicts some blocks. When memory runs low,
+    the reclaimer also evicts unused clean blocks, see `register_shrinker`.
  */
 #define EVICTION_THRESHOLD 20
+#define BCACHE_MEM_SHARE 8
+
+/**
+    @brief how often the commit thread commits, see `set_bcache_committer`.
+ */
+#define COMMIT_INTERVAL_MS 50
+
+/**
+    @brief whether the kernel runs its commit thread in async mode, see
+    `set_bcache_committer`. Off by default, so that every system call is
+    durable when it returns. Build with `-DASYNC_COMMIT=true` to let `end_op`
+    return early, with `fsync` as the barrier.
+ */
+#ifndef ASYNC_COMMIT
+#define ASYNC_COMMIT false
+#endif
+
+/**
+    @brief the replacement policies of block cache.
+
+    CACHE_LRU evicts the least recently used block. CACHE_2Q (the default)
+    keeps blocks read only once apart, so that a sequential scan does not
+    evict the blocks used over and over, e.g. inodes and bitmaps.
+ */
+typedef enum {
+    CACHE_LRU,
+    CACHE_2Q,
+    NUM_CACHE_POLICIES,
+} CachePolicy;
+
+/**
+    @brief the journaling modes of block cache.
+
+    JOURNAL_DATA logs every block synced. With JOURNAL_ORDERED (the default)
+    file data synced by `sync_data` is not logged, but written in place
+    before the transaction that references it commits, so only metadata is
+    written twice.
+ */
+typedef enum {
+    JOURNAL_DATA,
+    JOURNAL_ORDERED,
+} JournalMode;
+
+/**
+    @brief counters of block cache, kept for each policy since `init_bcache`.
+ */
+typedef struct {
+    usize hits;
+    usize misses;
+    usize evictions;
+} CacheStat;
 
 /**
     @brief a block in block cache.
@@ -33,16 +87,39 @@ typedef struct {
     usize block_no;
 
     /**
-        @brief list this block into a linked list.
+        @brief list this block into the LRU list.
 
-        @note should be protected by the global lock of the block cache.
+        @note should be protected by the LRU lock of the block cache.
      */
     ListNode node;
 
+    /**
+        @brief list this block into its hash bucket, see `block_no`.
+
+        @note should be protected by the lock of the bucket.
+     */
+    ListNode hash_node;
+
+    /**
+        @brief how many threads hold the block or wait for it. A block
+        is only evicted when it is 0.
+
+        @note should be protected by the lock of the bucket.
+     */
+    usize refcnt;
+
+    /**
+        @brief is the block in the queue of blocks read only once? see
+        `CACHE_2Q`.
+
+        @note should be protected by the LRU lock of the block cache.
+     */
+    bool in_a1;
+
     /**
         @brief is the block already acquired by some thread or process?
 
-        @note should be protected by the global lock of the block cache.
+        @note should be protected by `lock`.
      */
     bool acquired;
 
@@ -53,7 +130,7 @@ typedef struct {
 
         e.g. it is dirty.
 
-        @note should be protected by the global lock of the block cache.
+        @note only changed by the holder of the block.
      */
     bool pinned;
 
@@ -162,6 +239,15 @@ typedef struct {
      */
     void (*begin_op)(OpContext *ctx);
 
+    /**
+        @brief like `begin_op`, but reserve log space for `num_blocks`
+        blocks instead of `OP_MAX_NUM_BLOCKS`, e.g. for a large write.
+
+        @return the number of blocks reserved: `num_blocks`, or less if it
+        is more than half the log (but no less than `OP_MAX_NUM_BLOCKS`).
+     */
+    usize (*begin_sized_op)(OpContext *ctx, usize num_blocks);
+
     /**
         @brief synchronize the content of `block` to disk.
 
@@ -175,14 +261,27 @@ typedef struct {
         @note the caller must hold the lock of `block`.
 
         @throw panic if the number of blocks associated with `ctx` is larger
-                than `OP_MAX_NUM_BLOCKS` after `sync`
+                than its reservation (`OP_MAX_NUM_BLOCKS` by default) after `sync`
      */
     void (*sync)(OpContext *ctx, Block *block);
 
+    /**
+        @brief like `sync`, for blocks of file data only.
+
+        In JOURNAL_ORDERED mode the block is written home when the running
+        transaction commits, before its log, and takes no log space. A block
+        still in the log of an earlier transaction is logged as by `sync`, so
+        that replaying the log cannot overwrite it.
+
+        @note the caller must hold the lock of `block`.
+     */
+    void (*sync_data)(OpContext *ctx, Block *block);
+
     /**
         @brief end the atomic operation managed by `ctx`.
 
-        It sleeps until all associated blocks are written to disk.
+        It sleeps until all associated blocks are written to disk, unless
+        the commit thread runs asynchronously, see `set_bcache_committer`.
 
         @param ctx the atomic operation context to be ended.
 
@@ -190,6 +289,13 @@ typedef struct {
      */
     void (*end_op)(OpContext *ctx);
 
+    /**
+        @brief make all ended atomic operations durable, e.g. for `fsync`.
+
+        It only has to wait if `end_op` does not, see `set_bcache_committer`.
+     */
+    void (*flush)();
+
     // # NOTES FOR BITMAP
     //
     // every block on disk has a bit in bitmap, including blocks inside bitmap!
@@ -218,11 +324,22 @@ typedef struct {
      */
     usize (*alloc)(OpContext *ctx);
 
+    /**
+        @brief like `alloc`, but take the first free block from `goal` on,
+        e.g. the block after the previous one of a file, so that files are
+        laid out contiguously. `alloc` starts where the last one ended.
+     */
+    usize (*alloc_near)(OpContext *ctx, usize goal);
+
     /**
         @brief free the block at `block_no` in bitmap.
 
         It will NOT panic if `block_no` is already free or invalid.
 
+        The block is not allocated again before the transaction of `ctx`
+        commits, so that no ordered write lands on it while the file that
+        frees it may still own it after a crash.
+
         @param ctx since this function may write on-disk bitmap, it must be
                    associated with an atomic operation.
                    The caller must ensure that `ctx` is **running**.
@@ -252,4 +369,38 @@ extern BlockCache bcache;
 
     @note You may want to put it into `*_init` method groups.
  */
-void init_bcache(const SuperBlock *sblock, const BlockDevice *device);
\ No newline at end of file
+void init_bcache(const SuperBlock *sblock, const BlockDevice *device);
+
+/**
+    @brief select the replacement policy of block cache. The blocks cached
+    are kept.
+ */
+void set_bcache_policy(CachePolicy policy);
+
+void get_bcache_stat(CachePolicy policy, CacheStat *stat);
+
+/**
+    @brief select the journaling mode of block cache, between transactions.
+ */
+void set_bcache_journal_mode(JournalMode mode);
+
+/**
+    @brief hand commits over to a journal commit thread, which calls
+    `bcache_commit` in a loop. Transactions then batch the operations that
+    end until the log is half full, someone waits for them, or the commit
+    thread is kicked, e.g. every COMMIT_INTERVAL_MS.
+
+    @param async if true, `end_op` returns before the operation is durable.
+ */
+void set_bcache_committer(bool async);
+
+/**
+    @brief wait until kicked, and commit the running transaction if it can
+    be committed. The body of the commit thread.
+ */
+void bcache_commit();
+
+/**
+    @brief wake the commit thread up. Safe in a timer handler.
+ */
+void bcache_kick_commit();
\ No newline at end of file
@@ -8,8 +8,11 @@
 
 #define BLOCK_SIZE 512
 
+// the log header takes so many blocks at the start of the log.
+#define LOG_HEADER_BLOCKS 4
+
 // maximum number of distinct block numbers can be recorded in the log header.
-#define LOG_MAX_SIZE ((BLOCK_SIZE - sizeof(usize)) / sizeof(usize))
+#define LOG_MAX_SIZE ((LOG_HEADER_BLOCKS * BLOCK_SIZE - 3 * sizeof(usize)) / sizeof(usize))
 
 #define INODE_NUM_DIRECT 12
 #define INODE_NUM_INDIRECT (BLOCK_SIZE / sizeof(u32))
@@ -69,10 +72,16 @@ typedef struct dirent {
     char name[FILE_NAME_MAX_LENGTH];
 } DirEntry;
 
+// `checksum` is the CRC32C of the logged blocks followed by `block_no`, and
+// `prev_checksum` the same of the first `prev_blocks` of them: the log as of
+// the commit before, which is still good if the last one was torn.
 typedef struct {
     usize num_blocks;
+    usize prev_blocks;
+    u32 checksum;
+    u32 prev_checksum;
     usize block_no[LOG_MAX_SIZE];
 } LogHeader;
 
 // mkfs only
-#define FSSIZE 1000 // Size of file system in blocks
\ No newline at end of file
+#define FSSIZE 4096 // Size of file system in blocks
\ No newline at end of file
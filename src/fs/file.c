@@ -6,6 +6,12 @@
 #include <fs/inode.h>
 #include <fs/pipe.h>
 #include <kernel/mem.h>
+#include <kernel/pagecache.h>
+#include <kernel/uaccess.h>
+
+// blocks read ahead of sequential reads at first / at most.
+#define RA_MIN_BLOCKS 8
+#define RA_MAX_BLOCKS 128
 
 // the global file table.
 static struct ftable ftable = {.lock = {0}, .filelist = {{0}}};
@@ -28,6 +34,9 @@ struct file *file_alloc() {
     for (int i = 0; i < NFILE; i++) {
         if (ftable.filelist[i].ref == 0) {
             ftable.filelist[i].ref = 1;
+            ftable.filelist[i].ra_prev = 0;
+            ftable.filelist[i].ra_start = 0;
+            ftable.filelist[i].ra_size = 0;
             release_spinlock(&ftable.lock);
             return &(ftable.filelist[i]);
         }
@@ -78,18 +87,65 @@ int file_stat(struct file *f, struct stat *st) {
     return 0;
 }
 
+/*
+ * Keep a window of blocks read ahead in front of sequential reads. Once a
+ * read gets past half of the window the next one is read, twice as large.
+ * A sequential read outside the window starts a new one after it, and a
+ * read elsewhere shrinks the window by half.
+ */
+static void file_readahead(struct file *f, usize n) {
+    usize first = f->off / BLOCK_SIZE;
+    usize next = (f->off + n + BLOCK_SIZE - 1) / BLOCK_SIZE;  // the block after this read
+    usize end = f->ra_start + f->ra_size;
+    bool seq = f->off == f->ra_prev;
+    f->ra_prev = f->off + n;
+
+    if (f->ra_size && first >= f->ra_start && first < end) {
+        if (next < f->ra_start + f->ra_size / 2)
+            return;
+        f->ra_start = MAX(end, next);
+        f->ra_size = MIN(f->ra_size * 2, (u32)RA_MAX_BLOCKS);
+    } else if (seq) {
+        f->ra_start = next;
+        f->ra_size = MAX(f->ra_size, (u32)RA_MIN_BLOCKS);
+    } else {
+        f->ra_size /= 2;
+        return;
+    }
+    if ((usize)f->ra_start * BLOCK_SIZE < f->ip->entry.num_bytes)
+        pagecache_readahead_blocks(f->ip, f->ra_start, f->ra_size);
+}
+
 /* Read from file f. */
 isize file_read(struct file *f, char *addr, isize n) {
     if (!f->readable)
         return -1;
     if (f->type == FD_PIPE)
         return pipe_read(f->pipe, (u64)addr, n);
-    if (f->type == FD_INODE) {
+    if (f->type == FD_INODE && f->ip->entry.type == INODE_DEVICE) {
         inodes.lock(f->ip);
-        usize size = inodes.read(f->ip, (u8 *)addr, f->off, n);
-        f->off += size;
+        isize r = (isize)inodes.read(f->ip, (u8 *)addr, 0, n);
         inodes.unlock(f->ip);
-        return size;
+        return r;
+    }
+    if (f->type == FD_INODE) {
+        char *kbuf = file_iobuf();
+        isize done = 0;
+        while (done < n) {
+            isize m = MIN(n - done, (isize)FILE_IOBUF_SIZE);
+            inodes.lock(f->ip);
+            usize size = inodes.read(f->ip, (u8 *)kbuf, f->off, m);
+            if (size > 0 && f->ip->entry.type == INODE_REGULAR)
+                file_readahead(f, size);
+            f->off += size;
+            inodes.unlock(f->ip);
+            usize left = copy_to_user(addr + done, kbuf, size);
+            f->off -= left;  // not read after all
+            done += size - left;
+            if (left || (isize)size < m)
+                return done > 0 || !left ? done : -1;
+        }
+        return done;
     }
     PANIC();
     return 0;
@@ -101,29 +157,41 @@ isize file_write(struct file *f, char *addr, isize n) {
         return -1;
     if (f->type == FD_PIPE)
         return pipe_write(f->pipe, (u64)addr, n);
+    if (f->type == FD_INODE && f->ip->entry.type == INODE_DEVICE) {
+        inodes.lock(f->ip);
+        isize w = (isize)inodes.write(NULL, f->ip, (u8 *)addr, 0, n);
+        inodes.unlock(f->ip);
+        return w;
+    }
     if (f->type == FD_INODE) {
-        isize maxbytes = ((OP_MAX_NUM_BLOCKS - 4) / 2) * BLOCK_SIZE;
+        char *kbuf = file_iobuf();
+        isize idx = 0;
+        usize left = 0;
         // 2 blocks for each write block
         // 1 block for inode
         // 1 block for map
         // 2 blocks for IndirectBlock
-        isize idx = 0;
-        while (idx < n) {
-            isize len = MIN(n - idx, maxbytes);
+        while (idx < n && !left) {
             OpContext ctx;
-            bcache.begin_op(&ctx);
-            inodes.lock(f->ip);
-            isize reallen = inodes.write(&ctx, f->ip, (u8 *)(addr + idx), f->off, len);
-            // ASSERT(reallen==len);
-            f->off += reallen;
-            inodes.unlock(f->ip);
+            usize skip = f->off % BLOCK_SIZE;
+            usize want = 2 * ((skip + (n - idx) + BLOCK_SIZE - 1) / BLOCK_SIZE) + 4;
+            usize rm = bcache.begin_sized_op(&ctx, want);
+            isize maxbytes = (isize)(((rm - 4) / 2) * BLOCK_SIZE - skip);
+            isize len = MIN(n - idx, MIN(maxbytes, (isize)FILE_IOBUF_SIZE));
+            // copy as much as this op can log, outside the inode lock.
+            left = copy_from_user(kbuf, addr + idx, len);
+            len -= left;
+            if (len > 0) {
+                inodes.lock(f->ip);
+                isize reallen = inodes.write(&ctx, f->ip, (u8 *)kbuf, f->off, len);
+                f->off += reallen;
+                inodes.unlock(f->ip);
+                ASSERT(reallen == len);
+            }
             bcache.end_op(&ctx);
-            ASSERT(reallen == len);
-            idx += reallen;
+            idx += len;
         }
-        if (idx == n)
-            return n;
-        return -1;
+        return idx > 0 ? idx : -1;
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <aarch64/mmu.h>
 #include <common/defines.h>
 #include <common/sem.h>
 #include <fs/defines.h>
@@ -27,6 +28,10 @@ typedef struct file {
     // offset of the file in bytes.
     // For a pipe, it is the number of bytes that have been written/read.
     usize off;
+    // readahead of blocks for sequential reads, see `file_read`.
+    usize ra_prev;   // where the last read ended
+    u32 ra_start;    // first block of the current readahead window
+    u32 ra_size;     // blocks in the window, 0 if there is none
 } File;
 
 struct ftable {
@@ -91,8 +96,10 @@ int file_stat(struct file* f, struct stat* st);
 /**
     @brief read the content of `f` with range [f->off, f->off + n).
 
+    If the buffer turns out not to be writable, the bytes read so far are
+    returned, as by a short read.
     
-    @param[out] addr the buffer to be filled.
+    @param[out] addr the buffer in user memory to be filled.
     @param n the number of bytes to read.
     @return isize the number of bytes actually read. -1 on error.
  */
@@ -101,8 +108,20 @@ isize file_read(struct file* f, char* addr, isize n);
 /**
     @brief write the content of `f` with range [f->off, f->off + n).
 
-    @param addr the buffer to be written.
+    @param addr the buffer in user memory to be written.
     @param n the number of bytes to write.
     @return isize the number of bytes actually written. -1 on error.
 */
-isize file_write(struct file* f, char* addr, isize n);
\ No newline at end of file
+isize file_write(struct file* f, char* addr, isize n);
+
+/**
+    @brief the buffer of the current process, of FILE_IOBUF_SIZE bytes, that
+    `file_read` and `file_write` copy the data of regular files through.
+    Copying user memory under the lock of an inode could fault on a mapping
+    of the same file, and the fault takes that lock too. Kept until exit.
+    It holds the data of the largest log reservation (see `begin_sized_op`),
+    so a large write commits one op per reservation rather than per page.
+ */
+#define FILE_IOBUF_SIZE (((LOG_MAX_SIZE / 2 - 4) / 2) * BLOCK_SIZE)
+
+char* file_iobuf();
\ No newline at end of file
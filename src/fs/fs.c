@@ -5,13 +5,37 @@
 #include <fs/inode.h>
 #include <fs/file.h>
 #include <common/defines.h>
+#include <kernel/cpu.h>
 #include <kernel/printk.h>
+#include <kernel/proc.h>
+
+static struct timer commit_timer;
+
+static void commit_timer_handler(struct timer* t) {
+    (void)t;
+    bcache_kick_commit();
+}
+
+static NO_RETURN void commit_thread(u64 arg) {
+    (void)arg;
+    while (true) {
+        // the timer stays armed on the CPU that set it until it fires.
+        if (commit_timer.triggered)
+            set_cpu_timer(&commit_timer);
+        bcache_commit();
+    }
+}
 
 void init_filesystem() {
     init_block_device();
 
     const SuperBlock* sblock = get_super_block();
     init_bcache(sblock, &block_device);
+    commit_timer.triggered = true;
+    commit_timer.elapse = COMMIT_INTERVAL_MS;
+    commit_timer.handler = commit_timer_handler;
+    start_proc(create_proc(), commit_thread, 0);
+    set_bcache_committer(ASYNC_COMMIT);
     init_inodes(sblock, &bcache);
     init_ftable();
 }
@@ -1,7 +1,9 @@
+#include <common/bitmap.h>
 #include <common/string.h>
 #include <fs/inode.h>
 #include <kernel/console.h>
 #include <kernel/mem.h>
+#include <kernel/pagecache.h>
 #include <kernel/printk.h>
 #include <kernel/sched.h>
 #include <sys/stat.h>
@@ -26,22 +28,42 @@ static const BlockCache *cache;
 /**
     @brief global lock for inode layer.
 
-    Use it to protect anything you need.
-
-    e.g. the list of allocated blocks, ref counts, etc.
+    It protects the allocation state, see `used_inodes`. The in-memory
+    inodes have locks of their own, see `buckets`.
  */
 static SpinLock lock;
 
-/**
-    @brief the list of all allocated in-memory inodes.
+/*
+ * In-memory inodes are found through a hash table on `inode_no`, each bucket
+ * with its own lock, which also protects `Inode.rc`. All of them are on the
+ * LRU list, most recently got first; only those nobody holds are dropped.
+ *
+ * Locking order: `lru_lock`, then a bucket lock.
+ */
+#define NUM_BUCKETS 1021
+
+static struct {
+    SpinLock lock;
+    ListNode head;
+} buckets[NUM_BUCKETS];
+
+#define bucket_of(inode_no) (&buckets[(inode_no) % NUM_BUCKETS])
+
+static SpinLock lru_lock;  // protects the below, and `Inode.node`.
+static ListNode lru;       // most recently got first.
+static usize num_cached;
 
-    We use a linked list to manage all allocated inodes.
+/**
+    @brief the in-memory index of used inodes, rebuilt from disk by
+    `init_inodes`, so that allocation does not read every inode block.
 
-    You can implement your own data structure if you want better performance.
+    The inode entries on disk stay authoritative: an inode found free here
+    is only taken if it is free there too.
 
-    @see Inode
+    @note protected by `lock`.
  */
-static ListNode head;
+static BitmapCell *used_inodes;
+static usize inode_hint;  // where the next search without a goal starts.
 
 // return which block `inode_no` lives on.
 static INLINE usize to_block_no(usize inode_no) {
@@ -58,13 +80,138 @@ static INLINE u32 *get_addrs(Block *block) {
     return ((IndirectBlock *)block->data)->addrs;
 }
 
+/*
+ * The dentry cache maps (directory, name) to what `lookup` found there, 0
+ * if nothing, so that walking a path does not read the directories again.
+ * It is filled by `lookup` and kept up to date by `insert` and `remove`,
+ * which all run under the lock of the directory; `namex` reads it without.
+ * The least recently used entry is reused for a new one.
+ */
+#define DCACHE_SIZE 1024
+#define DCACHE_BUCKETS 251
+
+typedef struct {
+    ListNode node;       // in `dentry_lru`
+    ListNode hash_node;  // in `dentry_buckets`, if `parent` is not 0
+    usize parent;
+    usize inode_no;
+    char name[FILE_NAME_MAX_LENGTH];
+} Dentry;
+
+static SpinLock dentry_lock;  // protects the below.
+static Dentry dentries[DCACHE_SIZE];
+static ListNode dentry_lru;  // most recently used first.
+static ListNode dentry_buckets[DCACHE_BUCKETS];
+
+static ListNode *dentry_bucket(usize parent, const char *name) {
+    u64 h = 0xcbf29ce484222325 ^ parent;
+    for (int i = 0; i < FILE_NAME_MAX_LENGTH && name[i]; i++)
+        h = (h ^ (u8)name[i]) * 0x100000001b3;
+    return &dentry_buckets[h % DCACHE_BUCKETS];
+}
+
+// caller should acquire `dentry_lock`.
+static Dentry *dentry_find(usize parent, const char *name) {
+    ListNode *h = dentry_bucket(parent, name);
+    for (ListNode *p = h->next; p != h; p = p->next) {
+        Dentry *d = container_of(p, Dentry, hash_node);
+        if (d->parent == parent && !strncmp(d->name, name, FILE_NAME_MAX_LENGTH))
+            return d;
+    }
+    return NULL;
+}
+
+// look `name` up in directory `parent`. return false if it is not cached.
+static bool dcache_lookup(usize parent, const char *name, usize *inode_no) {
+    acquire_spinlock(&dentry_lock);
+    Dentry *d = dentry_find(parent, name);
+    if (d) {
+        *inode_no = d->inode_no;
+        _detach_from_list(&d->node);
+        _merge_list(&dentry_lru, &d->node);
+    }
+    release_spinlock(&dentry_lock);
+    return d != NULL;
+}
+
+// remember that `name` in directory `parent` is `inode_no`, 0 if nothing.
+static void dcache_set(usize parent, const char *name, usize inode_no) {
+    acquire_spinlock(&dentry_lock);
+    Dentry *d = dentry_find(parent, name);
+    if (!d) {
+        d = container_of(dentry_lru.prev, Dentry, node);
+        _detach_from_list(&d->hash_node);
+        d->parent = parent;
+        strncpy(d->name, name, FILE_NAME_MAX_LENGTH);
+        _merge_list(dentry_bucket(parent, name), &d->hash_node);
+    }
+    d->inode_no = inode_no;
+    _detach_from_list(&d->node);
+    _merge_list(&dentry_lru, &d->node);
+    release_spinlock(&dentry_lock);
+}
+
+// forget the entries of directory `parent`, whose number may be reused.
+static void dcache_purge(usize parent) {
+    acquire_spinlock(&dentry_lock);
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        Dentry *d = &dentries[i];
+        if (d->parent == parent) {
+            _detach_from_list(&d->hash_node);
+            d->parent = 0;
+            _detach_from_list(&d->node);
+            _merge_list(dentry_lru.prev, &d->node);  // reused first.
+        }
+    }
+    release_spinlock(&dentry_lock);
+}
+
+static usize inode_shrink(usize nr_pages);
+
 // initialize inode tree.
 void init_inodes(const SuperBlock *_sblock, const BlockCache *_cache) {
     init_spinlock(&lock);
-    init_list_node(&head);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        init_spinlock(&buckets[i].lock);
+        init_list_node(&buckets[i].head);
+    }
+    init_spinlock(&lru_lock);
+    init_list_node(&lru);
+    num_cached = 0;
+    init_spinlock(&dentry_lock);
+    init_list_node(&dentry_lru);
+    for (int i = 0; i < DCACHE_BUCKETS; i++)
+        init_list_node(&dentry_buckets[i]);
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        init_list_node(&dentries[i].node);
+        init_list_node(&dentries[i].hash_node);
+        dentries[i].parent = 0;
+        _merge_list(dentry_lru.prev, &dentries[i].node);
+    }
     sblock = _sblock;
     cache = _cache;
 
+    usize size = BITMAP_TO_NUM_CELLS(sblock->num_inodes) * sizeof(BitmapCell);
+    if (used_inodes)
+        kfree(used_inodes);
+    used_inodes = kalloc(size);
+    memset(used_inodes, 0, size);
+    bitmap_set(used_inodes, 0);  // never used.
+    Block *blk = NULL;
+    for (usize ino = 1; ino < sblock->num_inodes; ++ino) {
+        if (!blk || blk->block_no != to_block_no(ino)) {
+            if (blk)
+                cache->release(blk);
+            blk = cache->acquire(to_block_no(ino));
+        }
+        if (get_entry(blk, ino)->type != INODE_INVALID)
+            bitmap_set(used_inodes, ino);
+    }
+    if (blk)
+        cache->release(blk);
+    inode_hint = 1;
+    register_shrinker(inode_shrink);
+
     if (ROOT_INODE_NO < sblock->num_inodes) {
         inodes.root = inodes.get(ROOT_INODE_NO);
         if (inodes.root->entry.type != INODE_DIRECTORY)
@@ -78,35 +225,52 @@ static void init_inode(Inode *inode) {
     init_sleeplock(&inode->lock);
     init_rc(&inode->rc);
     init_list_node(&inode->node);
+    init_list_node(&inode->hash_node);
+    init_radix_tree(&inode->pages);
+    init_list_node(&inode->mappings);
     inode->inode_no = 0;
     inode->valid = false;
 }
 
 // see `inode.h`.
-static usize inode_alloc(OpContext *ctx, InodeType type) {
+static usize inode_alloc_near(OpContext *ctx, InodeType type, usize goal) {
     ASSERT(type != INODE_INVALID);
 
-    usize bno = 0;
-    Block *blk = cache->acquire(bno);
-    for (usize ino = 1; ino < sblock->num_inodes; ++ino) {
-        if (to_block_no(ino) != bno) {  // avoid frequent block acquire.
-            cache->release(blk);
-            blk = cache->acquire(bno = to_block_no(ino));
+    while (true) {
+        acquire_spinlock(&lock);
+        if (goal == 0 || goal >= sblock->num_inodes)
+            goal = inode_hint;
+        usize ino = bitmap_find_zero(used_inodes, goal, sblock->num_inodes);
+        if (ino == sblock->num_inodes)
+            ino = bitmap_find_zero(used_inodes, 1, sblock->num_inodes);
+        if (ino == sblock->num_inodes) {
+            release_spinlock(&lock);
+            break;
         }
+        bitmap_set(used_inodes, ino);
+        inode_hint = ino + 1;
+        release_spinlock(&lock);
+
+        Block *blk = cache->acquire(to_block_no(ino));
         if (get_entry(blk, ino)->type == INODE_INVALID) {
             *get_entry(blk, ino) = (InodeEntry){.type = type};  // zero-initialized.
             cache->sync(ctx, blk);
             cache->release(blk);
             return ino;
         }
+        cache->release(blk);  // used on disk after all, and stays marked.
     }
-    cache->release(blk);
 
     printk("(panic) inode_alloc: no more free inode.\n");
     PANIC();
     return 0;
 }
 
+// see `inode.h`.
+static usize inode_alloc(OpContext *ctx, InodeType type) {
+    return inode_alloc_near(ctx, type, 0);
+}
+
 // see `inode.h`.
 static void inode_lock(Inode *inode) {
     ASSERT(inode->rc.count > 0);
@@ -125,7 +289,7 @@ static void inode_sync(OpContext *ctx, Inode *inode, bool do_write) {
     if (!inode->valid) {
         Block *blk = cache->acquire(to_block_no(inode->inode_no));
         inode->entry = *get_entry(blk, inode->inode_no);
-        inode->valid = true;
+        __atomic_store_n(&inode->valid, true, __ATOMIC_RELEASE);
         cache->release(blk);
     } else if (do_write) {
         Block *blk = cache->acquire(to_block_no(inode->inode_no));
@@ -135,35 +299,100 @@ static void inode_sync(OpContext *ctx, Inode *inode, bool do_write) {
     }
 }
 
-#define for_list(head) for (ListNode *p = head.next; p != &head; p = p->next)
-
-// see `inode.h`.
-static Inode *inode_get(usize inode_no) {
-    ASSERT(inode_no > 0);
-    ASSERT(inode_no < sblock->num_inodes);
-    acquire_spinlock(&lock);
+// find `inode_no` in its bucket. caller should acquire the bucket lock.
+static Inode *lookup(usize inode_no) {
+    ListNode *h = &bucket_of(inode_no)->head;
+    for (ListNode *p = h->next; p != h; p = p->next) {
+        Inode *inode = container_of(p, Inode, hash_node);
+        if (inode->inode_no == inode_no)
+            return inode;
+    }
+    return NULL;
+}
 
-    Inode *inode = NULL;
-    for_list(head) if ((inode = container_of(p, Inode, node))->inode_no == inode_no) goto found;
+// take the least recently used inode nobody holds out of the table, and
+// return it, or NULL if there is none. caller should acquire `lru_lock`.
+static Inode *take_unused() {
+    for (ListNode *p = lru.prev; p != &lru; p = p->prev) {
+        Inode *inode = container_of(p, Inode, node);
+        SpinLock *bucket_lock = &bucket_of(inode->inode_no)->lock;
+        acquire_spinlock(bucket_lock);
+        if (inode->rc.count == 0) {
+            _detach_from_list(&inode->hash_node);
+            release_spinlock(bucket_lock);
+            _detach_from_list(p);
+            num_cached--;
+            return inode;
+        }
+        release_spinlock(bucket_lock);
+    }
+    return NULL;
+}
 
-    inode = kalloc(sizeof(Inode));
-    init_inode(inode);
-    inode->inode_no = inode_no;
-    _merge_list(&head, &inode->node);
+// free an inode taken by `take_unused`, with its cached pages.
+static void drop_inode(Inode *inode) {
+    // whoever did the last `put` may still hold the lock.
+    unalertable_acquire_sleeplock(&inode->lock);
+    pagecache_invalidate(inode, 0, (usize)-1);
+    release_sleeplock(&inode->lock);
+    kfree(inode);
+}
 
-found:
+// drop unused inodes until there are no more than `keep` or `nr` are dropped.
+// return how many were.
+static usize shrink_inodes(usize keep, usize nr) {
+    usize dropped = 0;
+    while (dropped < nr) {
+        acquire_spinlock(&lru_lock);
+        Inode *inode = num_cached > keep ? take_unused() : NULL;
+        release_spinlock(&lru_lock);
+        if (!inode)
+            break;
+        drop_inode(inode);
+        dropped++;
+    }
+    return dropped;
+}
 
-    increment_rc(&inode->rc);  // actually atomic, lock for fun.
-    release_spinlock(&lock);
+#define INODES_PER_PAGE (PAGE_SIZE / sizeof(Inode))
 
-    inode_lock(inode);
-    inode_sync(NULL, inode, false);
-    inode_unlock(inode);
+// the shrinker of the inode layer, see `register_shrinker`.
+static usize inode_shrink(usize nr_pages) {
+    return shrink_inodes(0, nr_pages * INODES_PER_PAGE) / INODES_PER_PAGE;
+}
 
-    if (inode == NULL) {
-        printk("inode_get: inode %llu is NULL\n", inode_no);
-        printk("This should not happen\n");
-        PANIC();
+// see `inode.h`.
+static Inode *inode_get(usize inode_no) {
+    ASSERT(inode_no > 0);
+    ASSERT(inode_no < sblock->num_inodes);
+    SpinLock *bucket_lock = &bucket_of(inode_no)->lock;
+    acquire_spinlock(bucket_lock);
+    Inode *inode = lookup(inode_no);
+    bool found = inode != NULL;
+    if (!found) {
+        inode = kalloc(sizeof(Inode));
+        init_inode(inode);
+        inode->inode_no = inode_no;
+        _merge_list(&bucket_of(inode_no)->head, &inode->hash_node);
+    }
+    increment_rc(&inode->rc);
+    release_spinlock(bucket_lock);
+
+    // the reference keeps it in the table while it is moved.
+    acquire_spinlock(&lru_lock);
+    _detach_from_list(&inode->node);
+    _merge_list(&lru, &inode->node);
+    if (!found)
+        num_cached++;
+    bool over = num_cached > INODE_CACHE_SIZE;
+    release_spinlock(&lru_lock);
+    if (over)
+        shrink_inodes(INODE_CACHE_SIZE, (usize)-1);
+
+    if (!__atomic_load_n(&inode->valid, __ATOMIC_ACQUIRE)) {
+        inode_lock(inode);
+        inode_sync(NULL, inode, false);
+        inode_unlock(inode);
     }
 
     return inode;
@@ -190,11 +419,15 @@ static void inode_clear(OpContext *ctx, Inode *inode) {
     }
     inode->entry.num_bytes = 0;
     inode_sync(ctx, inode, true);
+    pagecache_invalidate(inode, 0, (usize)-1);
 }
 
 // see `inode.h`.
 static Inode *inode_share(Inode *inode) {
+    SpinLock *bucket_lock = &bucket_of(inode->inode_no)->lock;
+    acquire_spinlock(bucket_lock);
     increment_rc(&inode->rc);
+    release_spinlock(bucket_lock);
     return inode;
 }
 
@@ -202,22 +435,56 @@ static Inode *inode_share(Inode *inode) {
 static void inode_put(OpContext *ctx, Inode *inode) {
     unalertable_acquire_sleeplock(&inode->lock);
 
-    decrement_rc(&inode->rc);
-    if (inode->rc.count || inode->entry.num_links) {
+    // the last reference of an unlinked inode is only dropped once it is
+    // freed on disk: until then `get` finds this one, not the stale entry.
+    // `num_links` cannot change while we hold the lock.
+    SpinLock *bucket_lock = &bucket_of(inode->inode_no)->lock;
+    acquire_spinlock(bucket_lock);
+    bool last = inode->rc.count == 1 && inode->entry.num_links == 0;
+    if (!last)
+        decrement_rc(&inode->rc);  // an unused inode stays cached, see `take_unused`.
+    release_spinlock(bucket_lock);
+    if (!last) {
         release_sleeplock(&inode->lock);
         return;
     }
 
+    if (inode->entry.type == INODE_DIRECTORY)
+        dcache_purge(inode->inode_no);
     inode->entry.type = INODE_INVALID;
     inode_clear(ctx, inode);
     inode_sync(ctx, inode, true);
 
-    detach_from_list(&lock, &inode->node);
+    acquire_spinlock(&lru_lock);
+    acquire_spinlock(bucket_lock);
+    decrement_rc(&inode->rc);
+    bool gone = inode->rc.count == 0;
+    if (gone)
+        _detach_from_list(&inode->hash_node);
+    release_spinlock(bucket_lock);
+    if (gone) {
+        _detach_from_list(&inode->node);
+        num_cached--;
+    }
+    release_spinlock(&lru_lock);
+    if (!gone) {
+        // got by someone meanwhile, whose `put` frees it.
+        release_sleeplock(&inode->lock);
+        return;
+    }
+
+    // free for `alloc` only once `get` can no longer find this one.
+    acquire_spinlock(&lock);
+    bitmap_clear(used_inodes, inode->inode_no);
+    release_spinlock(&lock);
 
     release_sleeplock(&inode->lock);  // not necessary, since immediately freed.
     kfree(inode);
 }
 
+// the goal to allocate the block after `block_no` at, see `alloc_near`.
+#define NEXT_BLOCK(block_no) ((block_no) ? (block_no) + 1 : 0)
+
 /**
     @brief get which block is the offset of the inode in.
 
@@ -244,17 +511,20 @@ static usize inode_map(OpContext *ctx,
                        Inode *inode,
                        usize offset,
                        bool *modified) {
+    // new blocks go right after the block before them, if there is one.
     if (offset < INODE_NUM_DIRECT) {
         if (inode->entry.addrs[offset] == 0) {
             *modified = true;
-            inode->entry.addrs[offset] = cache->alloc(ctx);
+            usize goal = offset > 0 ? NEXT_BLOCK(inode->entry.addrs[offset - 1]) : 0;
+            inode->entry.addrs[offset] = cache->alloc_near(ctx, goal);
             inode_sync(ctx, inode, true);  // attention
         }
         return inode->entry.addrs[offset];
     }
 
     if (inode->entry.indirect == 0) {
-        inode->entry.indirect = cache->alloc(ctx);
+        usize goal = NEXT_BLOCK(inode->entry.addrs[INODE_NUM_DIRECT - 1]);
+        inode->entry.indirect = cache->alloc_near(ctx, goal);
         inode_sync(ctx, inode, true);
     }
 
@@ -262,7 +532,8 @@ static usize inode_map(OpContext *ctx,
     u32 *addr = &get_addrs(inblock)[offset - INODE_NUM_DIRECT];
     if (*addr == 0) {
         *modified = true;
-        *addr = cache->alloc(ctx);
+        usize goal = NEXT_BLOCK(offset > INODE_NUM_DIRECT ? addr[-1] : inode->entry.indirect);
+        *addr = cache->alloc_near(ctx, goal);
         cache->sync(ctx, inblock);
     }
     usize bno = *addr;
@@ -277,7 +548,11 @@ static ALWAYS_INLINE void rw(OpContext *ctx, Inode *inode, u8 *buf, usize *off,
         Block *blk = cache->acquire(bno);
         if (WRITE) {
             memcpy(blk->data + *off % BLOCK_SIZE, buf, len);
-            cache->sync(ctx, blk);
+            // directories are metadata, and logged.
+            if (inode->entry.type == INODE_REGULAR)
+                cache->sync_data(ctx, blk);
+            else
+                cache->sync(ctx, blk);
         } else
             memcpy(buf, blk->data + *off % BLOCK_SIZE, len);
         cache->release(blk);
@@ -300,10 +575,44 @@ static usize inode_read(Inode *inode, u8 *dest, usize offset, usize count) {
     ASSERT(end <= entry->num_bytes);
     ASSERT(offset <= end);
 
-    rw(NULL, inode, dest, &offset, end, false);
+    // a cached page can be newer than the blocks, e.g. written by a shared mapping.
+    while (offset < end) {
+        usize n = MIN(end - offset, PAGE_SIZE - offset % PAGE_SIZE);
+        void *page = inode->pages.root ? pagecache_lookup(inode, offset / PAGE_SIZE) : NULL;
+        if (page) {
+            memcpy(dest, page + offset % PAGE_SIZE, n);
+            kfree_page(page);
+            offset += n;
+        } else
+            rw(NULL, inode, dest, &offset, offset + n, false);
+        dest += n;
+    }
     return count;
 }
 
+// look up so many block numbers at a time in `inode_readahead`.
+#define READAHEAD_BATCH 16
+
+// see `inode.h`.
+static void inode_readahead(Inode *inode, usize index, usize count) {
+    usize bnos[READAHEAD_BATCH], end = index + count;
+    while (index < end) {
+        usize n = 0;
+        inode_lock(inode);
+        if (inode->entry.type == INODE_REGULAR) {
+            usize last = MIN(end, (inode->entry.num_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            for (; index < last && n < READAHEAD_BATCH; index++)
+                bnos[n++] = inode_map(NULL, inode, index, &(bool){0});
+        }
+        inode_unlock(inode);
+        if (n == 0)
+            break;
+        // a block freed meanwhile is only cached for nothing.
+        for (usize i = 0; i < n; i++)
+            cache->release(cache->acquire(bnos[i]));
+    }
+}
+
 // see `inode.h`.
 static usize inode_write(OpContext *ctx,
                          Inode *inode,
@@ -325,6 +634,7 @@ static usize inode_write(OpContext *ctx,
         inode_sync(ctx, inode, true);
     }
 
+    pagecache_update(inode, src, offset, count);
     rw(ctx, inode, src, &offset, end, true);
     return count;
 }
@@ -335,15 +645,21 @@ static usize inode_lookup(Inode *inode, const char *name, usize *index) {
     InodeEntry *entry = &inode->entry;
     ASSERT(entry->type == INODE_DIRECTORY);
 
+    usize inode_no;
+    if (!index && dcache_lookup(inode->inode_no, name, &inode_no))
+        return inode_no;
+
     for (usize i = 0; i < entry->num_bytes; i += sizeof(DirEntry)) {
         DirEntry dir;
         inode_read(inode, (u8 *)&dir, i, sizeof(DirEntry));
         if (dir.inode_no && !strncmp(name, dir.name, FILE_NAME_MAX_LENGTH)) {
             if (index)
                 *index = i;
+            dcache_set(inode->inode_no, name, dir.inode_no);
             return dir.inode_no;
         }
     }
+    dcache_set(inode->inode_no, name, 0);
     return 0;
 }
 
@@ -364,6 +680,7 @@ static usize inode_insert(OpContext *ctx,
 
     usize index = inode->entry.num_bytes;
     inode_write(ctx, inode, (u8 *)&dir, index, sizeof(DirEntry));
+    dcache_set(inode->inode_no, name, inode_no);
     return index;
 }
 
@@ -371,12 +688,15 @@ static usize inode_insert(OpContext *ctx,
 static void inode_remove(OpContext *ctx, Inode *inode, usize index) {
     DirEntry dir;
     inode_read(inode, (u8 *)&dir, index, sizeof(DirEntry));
+    if (dir.inode_no)
+        dcache_set(inode->inode_no, dir.name, 0);
     dir.inode_no = 0;
     inode_write(ctx, inode, (u8 *)&dir, index, sizeof(DirEntry));
 }
 
 InodeTree inodes = {
     .alloc = inode_alloc,
+    .alloc_near = inode_alloc_near,
     .lock = inode_lock,
     .unlock = inode_unlock,
     .sync = inode_sync,
@@ -389,6 +709,7 @@ InodeTree inodes = {
     .lookup = inode_lookup,
     .insert = inode_insert,
     .remove = inode_remove,
+    .readahead = inode_readahead,
 };
 
 /**
@@ -458,25 +779,24 @@ static Inode *namex(const char *path,
         ip = inode_share(thisproc()->cwd);
     }
     while ((path = skipelem(path, name)) != 0) {
-        inode_lock(ip);
+        // the type of an inode we hold only changes when it is freed.
         if (ip->entry.type != INODE_DIRECTORY) {
-            inode_unlock(ip);
             inode_put(ctx, ip);
             return NULL;
         }
 
-        if (nameiparent && *path == '\0') {
-            inode_unlock(ip);
+        if (nameiparent && *path == '\0')
             return ip;
-        }
-        usize ino = inode_lookup(ip, name, 0);
-        if (ino == 0) {
+        // only scan the directory, under its lock, if the name is not cached.
+        usize ino;
+        if (!dcache_lookup(ip->inode_no, name, &ino)) {
+            inode_lock(ip);
+            ino = inode_lookup(ip, name, 0);
             inode_unlock(ip);
-            inode_put(ctx, ip);
-            return NULL;
         }
-        inode_unlock(ip);
         inode_put(ctx, ip);
+        if (ino == 0)
+            return NULL;
         ip = inode_get(ino);
     }
 
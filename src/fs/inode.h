@@ -1,5 +1,6 @@
 #pragma once
 #include <common/list.h>
+#include <common/radix_tree.h>
 #include <common/rc.h>
 #include <common/spinlock.h>
 #include <fs/cache.h>
@@ -37,10 +38,17 @@ typedef struct {
     RefCount rc;
 
     /**
-        @brief link this inode into a linked list.
+        @brief list this inode into the LRU list of the inode layer.
      */
     ListNode node;
 
+    /**
+        @brief list this inode into its hash bucket, see `inode_no`.
+
+        @note `rc` is protected by the lock of the bucket too.
+     */
+    ListNode hash_node;
+
     /**
         @brief the corresponding inode number on disk.
 
@@ -59,8 +67,28 @@ typedef struct {
         @brief the real in-memory copy of the inode on disk.
      */
     InodeEntry entry; 
+
+    /**
+        @brief the cached pages of the file content, indexed by page number.
+
+        @see `CachedPage` in `kernel/pagecache.h`.
+     */
+    RadixTree pages;
+
+    /**
+        @brief the `MAP_SHARED` sections mapping this file, linked by
+        `section.mapnode` and protected by the page cache lock.
+     */
+    ListNode mappings;
 } Inode;
 
+/**
+    @brief at most so many inodes are kept in memory after their last `put`.
+    The least recently used ones are dropped beyond it, together with their
+    cached pages, and when memory runs low (see `register_shrinker`).
+ */
+#define INODE_CACHE_SIZE 1024
+
 /**
     @brief interface of inode layer.
  */
@@ -83,6 +111,13 @@ typedef struct {
      */
     usize (*alloc)(OpContext* ctx, InodeType type);
 
+    /**
+        @brief like `alloc`, but take the first free inode from `goal` on,
+        e.g. the parent directory, so that the inodes of a directory share
+        inode blocks. `alloc` starts where the last one ended.
+     */
+    usize (*alloc_near)(OpContext* ctx, InodeType type, usize goal);
+
     /**
         @brief acquire the sleep lock of `inode`.
         
@@ -181,6 +216,8 @@ typedef struct {
 
     /**
         @brief read `count` bytes from `inode`, beginning at `offset`, to `dest`.
+
+        For a device, `dest` is in user memory, which the driver copies to.
         
         @return how many bytes you actually read.
 
@@ -190,6 +227,8 @@ typedef struct {
 
     /**
         @brief write `count` bytes from `src` to `inode`, beginning at `offset`.
+
+        For a device, `src` is in user memory, which the driver copies from.
         
         @return how many bytes you actually write.
 
@@ -207,6 +246,10 @@ typedef struct {
         @param[out] index the index of found entry in this directory.
 
         @return the inode number of the corresponding inode, or 0 if not found.
+
+        @note results are remembered in the dentry cache and reused when
+        `index` is NULL, so directories must only be changed through
+        `insert` and `remove`.
         
         @note caller must hold the lock of `inode`.
 
@@ -249,6 +292,15 @@ typedef struct {
         @throw panic if `inode` is not a directory.
      */
     void (*remove)(OpContext* ctx, Inode* inode, usize index);
+
+    /**
+        @brief read blocks [index, index + count) of `inode` into the block
+        cache, stopping at the end of file.
+
+        @note caller must NOT hold the lock of `inode`. It is only held while
+        looking up the block numbers, not during the reads.
+     */
+    void (*readahead)(Inode* inode, usize index, usize count);
 } InodeTree;
 
 /**
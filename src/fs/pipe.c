@@ -3,11 +3,14 @@
 #include <kernel/mem.h>
 #include <kernel/printk.h>
 #include <kernel/sched.h>
+#include <kernel/uaccess.h>
 
 static ALWAYS_INLINE void init_pipe(Pipe *pi) {
     init_spinlock(&pi->lock);
     init_sem(&pi->wlock, 0);
     init_sem(&pi->rlock, 0);
+    init_sleeplock(&pi->rmutex);
+    init_sleeplock(&pi->wmutex);
     // memset(pi->data, 0, PIPE_SIZE);
     pi->nread = 0;
     pi->nwrite = 0;
@@ -71,41 +74,71 @@ void pipe_close(Pipe *pi, int writable) {
     }
 }
 
+// copy `n` bytes between the ring from `pos` on and user `addr`. return
+// how many were NOT copied.
+static usize ring_copy(Pipe *pi, u32 pos, u64 addr, u32 n, bool to_user) {
+    u32 off = pos % PIPE_SIZE, first = MIN(n, PIPE_SIZE - off);
+    usize left = to_user ? copy_to_user((void *)addr, pi->data + off, first)
+                         : copy_from_user(pi->data + off, (void *)addr, first);
+    if (left || first == n)
+        return left + (n - first);
+    return to_user ? copy_to_user((void *)(addr + first), pi->data, n - first)
+                   : copy_from_user(pi->data, (void *)(addr + first), n - first);
+}
+
 int pipe_write(Pipe *pi, u64 addr, int n) {
+    unalertable_acquire_sleeplock(&pi->wmutex);
     acquire_spinlock(&pi->lock);
     int i = 0;
-    for (; i < n; i++) {
+    usize left = 0;
+    while (i < n && !left) {
         if (pi->readopen == 0 || thisproc()->killed) {
             release_spinlock(&pi->lock);
+            release_sleeplock(&pi->wmutex);
             return -1;
         }
-        while (pi->nwrite == pi->nread + PIPE_SIZE) {
+        // a small write waits until it fits as a whole.
+        u32 room = PIPE_SIZE - (pi->nwrite - pi->nread);
+        if (room == 0 || (n <= PIPE_SIZE && room < (u32)n)) {
             post_sem(&pi->rlock);
             release_spinlock(&pi->lock);
             unalertable_wait_sem(&pi->wlock);
+            acquire_spinlock(&pi->lock);
+            continue;
         }
-        pi->data[pi->nwrite++ % PIPE_SIZE] = *((char *)addr + i);
+        u32 m = MIN((u32)(n - i), room), pos = pi->nwrite;
+        release_spinlock(&pi->lock);
+        left = ring_copy(pi, pos, addr + i, m, false);
+        acquire_spinlock(&pi->lock);
+        pi->nwrite += m - left;
+        i += m - left;
     }
     post_sem(&pi->rlock);
     release_spinlock(&pi->lock);
-    return i;
+    release_sleeplock(&pi->wmutex);
+    return i > 0 ? i : -1;
 }
 
 int pipe_read(Pipe *pi, u64 addr, int n) {
+    unalertable_acquire_sleeplock(&pi->rmutex);
     acquire_spinlock(&pi->lock);
     while (pi->nread == pi->nwrite && pi->writeopen) {
         if (thisproc()->killed) {
             release_spinlock(&pi->lock);
+            release_sleeplock(&pi->rmutex);
             return -1;
         }
         release_spinlock(&pi->lock);
         unalertable_wait_sem(&pi->rlock);
+        acquire_spinlock(&pi->lock);
     }
-    int i = 0;
-    for (; i < n && pi->nread != pi->nwrite; i++) {
-        *((char *)addr + i) = pi->data[pi->nread++ % PIPE_SIZE];
-    }
+    u32 m = MIN((u32)n, pi->nwrite - pi->nread), pos = pi->nread;
+    release_spinlock(&pi->lock);
+    usize left = ring_copy(pi, pos, addr, m, true);
+    acquire_spinlock(&pi->lock);
+    pi->nread += m - left;
     post_sem(&pi->wlock);
     release_spinlock(&pi->lock);
-    return i;
+    release_sleeplock(&pi->rmutex);
+    return left && left == m ? -1 : (int)(m - left);
 }
@@ -5,11 +5,18 @@
 #include <fs/file.h>
 #include <common/sem.h>
 
+// a write of at most PIPE_SIZE bytes is not interleaved with other writes.
 #define PIPE_SIZE 512
 
+/*
+ * Data is copied between the ring and user memory without `lock`, which a
+ * fault could not sleep under: one reader and one writer at a time own
+ * their parts of the ring, and only move the counters under `lock`.
+ */
 typedef struct pipe {
     SpinLock lock;
     Semaphore wlock, rlock;
+    SleepLock rmutex, wmutex;
     char data[PIPE_SIZE];
     u32 nread; // Number of bytes read
     u32 nwrite; // Number of bytes written
@@ -19,5 +26,6 @@ typedef struct pipe {
 
 int pipe_alloc(File **f0, File **f1);
 void pipe_close(Pipe *pi, int writable);
+// `addr` is in user memory. return how many bytes were copied, -1 if none.
 int pipe_write(Pipe *pi, u64 addr, int n);
 int pipe_read(Pipe *pi, u64 addr, int n);
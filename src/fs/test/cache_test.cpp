@@ -1,5 +1,7 @@
 extern "C" {
 #include <fs/cache.h>
+
+usize shrink_caches(usize nr);  // see `kernel/mem.h`.
 }
 
 #include "assert.hpp"
@@ -155,6 +157,74 @@ void test_lru()
     assert_true(mock.write_count < 5);
 }
 
+void test_shrink()
+{
+    initialize(OP_MAX_NUM_BLOCKS, 100);
+
+    for (usize i = 0; i < EVICTION_THRESHOLD; i++) {
+        auto *b = bcache.acquire(i);
+        bcache.release(b);
+    }
+
+    OpContext ctx;
+    bcache.begin_op(&ctx);
+    auto *pinned = bcache.acquire(1);
+    pinned->data[0] = 0xcc;
+    bcache.sync(&ctx, pinned);
+    bcache.release(pinned);
+    auto *held = bcache.acquire(2);
+
+    // only blocks nobody holds and no running operation modified go away.
+    while (shrink_caches(1) > 0) {
+    }
+    assert_eq(bcache.get_num_cached_blocks(), 2u);
+
+    usize rcnt = mock.read_count;
+    auto *b = bcache.acquire(1);
+    assert_eq(b->data[0], 0xcc);
+    bcache.release(b);
+    bcache.release(held);
+    assert_eq(mock.read_count.load(), rcnt);
+
+    bcache.end_op(&ctx);
+    assert_eq(mock.inspect(1)[0], 0xcc);
+}
+
+// not a check of any policy: compare their hit rates on a few hot blocks
+// (e.g. inodes and bitmaps) read in between sequential scans of files.
+void test_policy_benchmark()
+{
+    constexpr usize hot_size = EVICTION_THRESHOLD / 2;
+    constexpr usize scan_size = EVICTION_THRESHOLD * 4;
+    constexpr usize num_scans = 25;
+
+    double hit_rate[NUM_CACHE_POLICIES];
+    const char *names[NUM_CACHE_POLICIES] = { "LRU", "2Q" };
+    for (int p = 0; p < NUM_CACHE_POLICIES; p++) {
+        std::mt19937 gen(0xdeadbeef);
+        initialize(1, hot_size + scan_size * num_scans);
+        set_bcache_policy((CachePolicy)p);
+
+        usize scan_start = sblock.num_blocks - scan_size * num_scans;
+        for (usize i = 0; i < scan_size * num_scans; i++) {
+            auto *b = bcache.acquire(scan_start + i);
+            bcache.release(b);
+            if (i % 2 == 0) {
+                b = bcache.acquire(scan_start - 1 - gen() % hot_size);
+                bcache.release(b);
+            }
+        }
+
+        CacheStat stat;
+        get_bcache_stat((CachePolicy)p, &stat);
+        hit_rate[p] = (double)stat.hits / (stat.hits + stat.misses);
+        printf("(debug) %s: #hit = %zu, #miss = %zu, #evict = %zu, hit rate = %.3f\n",
+               names[p], stat.hits, stat.misses, stat.evictions, hit_rate[p]);
+    }
+
+    assert_true(hit_rate[CACHE_2Q] > hit_rate[CACHE_LRU]);
+}
+
 // targets: `begin_op`, `end_op`, `sync`.
 
 void test_atomic_op()
@@ -374,6 +444,7 @@ void test_replay()
             b[j] = v & 0xff;
         }
     }
+    mock.seal_log();
 
     init_bcache(&sblock, &device);
 
@@ -387,6 +458,185 @@ void test_replay()
     }
 }
 
+// a commit whose blocks did not all make it to disk is not replayed.
+void test_torn_log()
+{
+    initialize_mock(50, 1000);
+
+    auto *header = mock.inspect_log_header();
+    header->num_blocks = 8;
+    for (usize i = 0; i < 8; i++) {
+        header->block_no[i] = 500 + i;
+        mock.inspect_log(i)[0] = 0xcc;
+        mock.inspect(500 + i)[0] = 0;
+    }
+    mock.seal_log(5);
+    mock.inspect_log(6)[0] = 0xdd;
+
+    init_bcache(&sblock, &device);
+
+    assert_eq(header->num_blocks, 0u);
+    for (usize i = 0; i < 8; i++)
+        assert_eq(mock.inspect(500 + i)[0], i < 5 ? 0xcc : 0);
+
+    // nothing is replayed if the first commit is torn too.
+    header->num_blocks = 3;
+    mock.seal_log();
+    mock.inspect_log(0)[0] = 0xdd;
+    mock.inspect(501)[0] = 0;
+    init_bcache(&sblock, &device);
+    assert_eq(mock.inspect(501)[0], 0);
+}
+
+// a large operation reserves more than `OP_MAX_NUM_BLOCKS`, up to half the log.
+void test_sized_op()
+{
+    initialize(100, 1000);
+
+    OpContext ctx;
+    assert_eq(bcache.begin_sized_op(&ctx, 1000), 50u);
+    bcache.end_op(&ctx);
+
+    assert_eq(bcache.begin_sized_op(&ctx, 40), 40u);
+    for (usize i = 0; i < 40; i++) {
+        auto *b = bcache.acquire(500 + i);
+        b->data[0] = 0xcc;
+        bcache.sync(&ctx, b);
+        bcache.release(b);
+    }
+    bcache.end_op(&ctx);
+
+    for (usize i = 0; i < 40; i++)
+        assert_eq(mock.inspect(500 + i)[0], 0xcc);
+}
+
+// file data is written home before the log of its transaction, and once.
+void test_ordered_data()
+{
+    initialize(50, 1000);
+
+    std::vector<usize> writes;
+    mock.on_write = [&](usize bno, auto) { writes.push_back(bno); };
+
+    OpContext ctx;
+    bcache.begin_op(&ctx);
+    usize t = bcache.alloc(&ctx);  // zeroed and logged, ...
+    auto *b = bcache.acquire(t);
+    b->data[0] = 0xcc;
+    bcache.sync_data(&ctx, b);  // ... but file data after all.
+    bcache.release(b);
+    bcache.end_op(&ctx);
+
+    // the data, the header with the bitmap, the bitmap home and the header.
+    usize log = sblock.log_start, bitmap = sblock.bitmap_start;
+    std::vector<usize> expected = {t};
+    for (usize i = 0; i <= LOG_HEADER_BLOCKS; i++)
+        expected.push_back(log + i);
+    expected.insert(expected.end(), {bitmap, log});
+    assert_true(writes == expected);
+    assert_eq(mock.inspect(t)[0], 0xcc);
+
+    set_bcache_journal_mode(JOURNAL_DATA);
+    writes.clear();
+    bcache.begin_op(&ctx);
+    b = bcache.acquire(t);
+    b->data[0] = 0xdd;
+    bcache.sync_data(&ctx, b);
+    bcache.release(b);
+    bcache.end_op(&ctx);
+
+    expected.erase(expected.begin());
+    expected[expected.size() - 2] = t;
+    assert_true(writes == expected);
+    assert_eq(mock.inspect(t)[0], 0xdd);
+}
+
+// the log, the checkpoint and the replay are written in a few requests.
+void test_batched_io()
+{
+    initialize(50, 1000);
+
+    OpContext ctx;
+    bcache.begin_op(&ctx);
+    for (usize i = 0; i < OP_MAX_NUM_BLOCKS; i++) {
+        auto *b = bcache.acquire(500 + i);
+        b->data[0] = 0xcc;
+        bcache.sync(&ctx, b);
+        bcache.release(b);
+    }
+    usize rcnt = mock.request_count, wcnt = mock.write_count;
+    bcache.end_op(&ctx);
+
+    // the header with the data to the log, the data home and the header.
+    assert_eq(mock.request_count - rcnt, 3u);
+    assert_eq(mock.write_count - wcnt, 2 * OP_MAX_NUM_BLOCKS + LOG_HEADER_BLOCKS + 1);
+    for (usize i = 0; i < OP_MAX_NUM_BLOCKS; i++)
+        assert_eq(mock.inspect(500 + i)[0], 0xcc);
+
+    auto *header = mock.inspect_log_header();
+    header->num_blocks = 20;
+    for (usize i = 0; i < 20; i++) {
+        header->block_no[i] = 600 + i;
+        mock.inspect_log(i)[0] = (u8)i;
+    }
+    mock.seal_log();
+    rcnt = mock.request_count;
+    init_bcache(&sblock, &device);
+
+    // the header, the log, the data home, the header and then the bitmap.
+    assert_eq(mock.request_count - rcnt, 5u);
+    for (usize i = 0; i < 20; i++)
+        assert_eq(mock.inspect(600 + i)[0], (u8)i);
+}
+
+void test_deferred_checkpoint()
+{
+    using namespace std::chrono_literals;
+
+    initialize(100, 100);
+    set_bcache_committer(false);
+    std::atomic<bool> done = false;
+    std::thread committer([&] {
+        while (!done)
+            bcache_commit();
+    });
+
+    usize t = sblock.num_blocks - 1;
+    std::atomic<usize> home_writes = 0;
+    mock.on_write = [&](usize bno, auto) {
+        if (bno == t)
+            home_writes++;
+    };
+
+    for (usize i = 0; i < 10; i++) {
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        auto *b = bcache.acquire(t);
+        b->data[0] = i;
+        bcache.sync(&ctx, b);
+        bcache.release(b);
+        bcache.end_op(&ctx);
+    }
+
+    // every commit only appended a copy to the log.
+    auto *header = mock.inspect_log_header();
+    assert_eq(header->num_blocks, 10u);
+    assert_eq(mock.inspect_log(9)[0], 9);
+    assert_eq(home_writes.load(), 0u);
+
+    // the idle commit thread writes the block home once.
+    bcache_kick_commit();
+    for (int i = 0; i < 200 && header->num_blocks > 0; i++)
+        std::this_thread::sleep_for(10ms);
+    assert_eq(header->num_blocks, 0u);
+    assert_eq(home_writes.load(), 1u);
+    assert_eq(mock.inspect(t)[0], 9);
+
+    done = true;
+    bcache_kick_commit();
+    committer.join();
+}
+
 // targets: `alloc`, `free`.
 
 void test_alloc()
@@ -434,6 +684,36 @@ void test_alloc()
     assert_eq(panicked, true);
 }
 
+// allocation takes the first free block from the goal on, and wraps around.
+void test_alloc_near()
+{
+    initialize(100, 1000);
+    usize t = sblock.num_blocks - 10;
+
+    OpContext ctx;
+    bcache.begin_op(&ctx);
+    assert_eq(bcache.alloc_near(&ctx, t), t);
+    assert_eq(bcache.alloc_near(&ctx, t), t + 1);
+    assert_eq(bcache.alloc(&ctx), t + 2);  // after the last one
+    bcache.end_op(&ctx);
+
+    bcache.begin_op(&ctx);
+    for (usize i = t + 3; i < sblock.num_blocks; i++)
+        assert_eq(bcache.alloc(&ctx), i);
+    bcache.end_op(&ctx);
+
+    bcache.begin_op(&ctx);
+    usize b = bcache.alloc(&ctx);
+    assert_true(b < t);
+    bcache.free(&ctx, t + 1);
+    assert_true(bcache.alloc_near(&ctx, t) < t);  // not before the free commits
+    bcache.end_op(&ctx);
+
+    bcache.begin_op(&ctx);
+    assert_eq(bcache.alloc_near(&ctx, t), t + 1);
+    bcache.end_op(&ctx);
+}
+
 void test_alloc_free()
 {
     constexpr usize num_rounds = 5;
@@ -681,6 +961,56 @@ void test_simple_crash()
     }
 }
 
+// a block freed and allocated again in one transaction is not written in
+// place before the free commits, or the old file would get the new data.
+void test_free_reuse()
+{
+    int child;
+    if ((child = fork()) == IN_CHILD) {
+        initialize(100, 100);
+
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        usize t = bcache.alloc(&ctx);
+        auto *b = bcache.acquire(t);
+        b->data[0] = 0x19;
+        bcache.sync_data(&ctx, b);
+        bcache.release(b);
+        bcache.end_op(&ctx);
+
+        bcache.begin_op(&ctx);
+        bcache.free(&ctx, t);
+        b = bcache.acquire(bcache.alloc_near(&ctx, t));
+        b->data[0] = 0xcc;
+        bcache.sync_data(&ctx, b);
+        bcache.release(b);
+
+        // power off after the data is written, at the commit.
+        mock.on_write = [&](usize bno, auto) {
+            if (bno == sblock.log_start)
+                mock.offline = true;
+        };
+
+        try {
+            bcache.end_op(&ctx);
+        } catch (const Offline &) {
+        }
+
+        mock.on_write = nullptr;
+        mock.dump("sd.img");
+
+        exit(0);
+    } else {
+        wait_process(child);
+        initialize(100, 100, "sd.img");
+
+        // the first data block, which the child allocated.
+        usize t = sblock.num_blocks - 100;
+        assert_eq(mock.inspect(t)[0], 0x19);
+        assert_eq((mock.inspect(sblock.bitmap_start)[t / 8] >> (t % 8)) & 1, 1);
+    }
+}
+
 void test_parallel(usize num_rounds, usize num_workers, usize delay_ms,
                    usize log_cut)
 {
@@ -781,7 +1111,8 @@ void test_parallel(usize num_rounds, usize num_workers, usize delay_ms,
     puts("");
 }
 
-void test_banker()
+// with `async`, a commit thread batches the operations, which do not wait.
+void test_banker(bool async)
 {
     using namespace std::chrono_literals;
 
@@ -801,6 +1132,16 @@ void test_banker()
         int child;
         if ((child = fork()) == IN_CHILD) {
             initialize(log_size, num_accounts);
+            if (async) {
+                set_bcache_committer(true);
+                std::thread([] {
+                    try {
+                        while (true)
+                            bcache_commit();
+                    } catch (const Offline &) {
+                    }
+                }).detach();
+            }
 
             auto begin_ts = std::chrono::steady_clock::now();
 
@@ -817,6 +1158,7 @@ void test_banker()
                 bcache.release(b);
                 bcache.end_op(&ctx);
             }
+            bcache.flush();
 
             std::random_device rd;
             std::atomic<usize> count = 0;
@@ -923,13 +1265,21 @@ int main()
         { "loop_read", basic::test_loop_read },
         { "reuse", basic::test_reuse },
         { "lru", basic::test_lru },
+        { "shrink", basic::test_shrink },
+        { "policy_benchmark", basic::test_policy_benchmark },
         { "atomic_op", basic::test_atomic_op },
         { "overflow", basic::test_overflow },
         { "resident", basic::test_resident },
         { "local_absorption", basic::test_local_absorption },
         { "global_absorption", basic::test_global_absorption },
         { "replay", basic::test_replay },
+        { "torn_log", basic::test_torn_log },
+        { "sized_op", basic::test_sized_op },
+        { "ordered_data", basic::test_ordered_data },
+        { "batched_io", basic::test_batched_io },
+        { "deferred_checkpoint", basic::test_deferred_checkpoint },
         { "alloc", basic::test_alloc },
+        { "alloc_near", basic::test_alloc_near },
         { "alloc_free", basic::test_alloc_free },
 
         { "concurrent_acquire", concurrent::test_acquire },
@@ -937,13 +1287,15 @@ int main()
         { "concurrent_alloc", concurrent::test_alloc },
 
         { "simple_crash", crash::test_simple_crash },
+        { "free_reuse", crash::test_free_reuse },
         { "single", [] { crash::test_parallel(1000, 1, 5, 0); } },
         { "parallel_1", [] { crash::test_parallel(1000, 2, 5, 0); } },
         { "parallel_2", [] { crash::test_parallel(1000, 4, 5, 0); } },
         { "parallel_3", [] { crash::test_parallel(500, 4, 10, 1); } },
         { "parallel_4",
           [] { crash::test_parallel(500, 4, 10, 2 * OP_MAX_NUM_BLOCKS); } },
-        { "banker", crash::test_banker },
+        { "banker", [] { crash::test_banker(false); } },
+        { "banker_async", [] { crash::test_banker(true); } },
     };
     Runner(tests).run();
 
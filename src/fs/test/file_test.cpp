@@ -0,0 +1,152 @@
+extern "C" {
+#include <fs/file.h>
+}
+
+#include "assert.hpp"
+#include "runner.hpp"
+
+#include <cstring>
+#include <vector>
+
+// `file_write` against an inode tree and a block cache that only count what
+// it asks for. the reservations are capped as `begin_sized_op` caps them.
+
+namespace
+{
+
+constexpr usize MAX_RESERVATION = LOG_MAX_SIZE / 2;
+
+usize num_ops, reserved;
+std::vector<u8> content;
+
+usize begin_sized_op(OpContext *ctx, usize num_blocks)
+{
+    assert_eq(reserved, 0);
+    num_ops++;
+    reserved = std::min(std::max(num_blocks, static_cast<usize>(OP_MAX_NUM_BLOCKS)),
+                        MAX_RESERVATION);
+    ctx->rm = reserved;
+    return reserved;
+}
+
+void end_op(OpContext *)
+{
+    reserved = 0;
+}
+
+void lock(Inode *) {}
+void unlock(Inode *) {}
+
+usize write(OpContext *ctx, Inode *, u8 *src, usize offset, usize count)
+{
+    usize blocks = (offset % BLOCK_SIZE + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    assert_eq(ctx->rm, reserved);
+    if (2 * blocks + 4 > reserved)
+        throw AssertionFailure("write exceeds its reservation");
+    if (content.size() < offset + count)
+        content.resize(offset + count);
+    memcpy(content.data() + offset, src, count);
+    return count;
+}
+
+char iobuf[FILE_IOBUF_SIZE];
+
+} // namespace
+
+extern "C" {
+
+BlockCache bcache;
+InodeTree inodes;
+
+char *file_iobuf()
+{
+    return iobuf;
+}
+
+usize copy_from_user(void *dst, const void *src, usize n)
+{
+    memcpy(dst, src, n);
+    return 0;
+}
+
+usize copy_to_user(void *dst, const void *src, usize n)
+{
+    memcpy(dst, src, n);
+    return 0;
+}
+
+// not reached by `file_write` on a regular file.
+void stati(Inode *, struct stat *) {}
+void pagecache_readahead_blocks(Inode *, usize, usize) {}
+int pipe_read(struct pipe *, u64, int) { return -1; }
+int pipe_write(struct pipe *, u64, int) { return -1; }
+void pipe_close(struct pipe *, int) {}
+
+}
+
+namespace
+{
+
+void write_file(usize offset, usize size)
+{
+    Inode inode {};
+    inode.entry.type = INODE_REGULAR;
+    File f {};
+    f.type = File::FD_INODE;
+    f.writable = true;
+    f.ip = &inode;
+    f.off = offset;
+
+    std::vector<u8> data(size);
+    for (usize i = 0; i < size; i++)
+        data[i] = static_cast<u8>(i * 7 + 1);
+
+    num_ops = 0;
+    content.clear();
+    assert_eq(file_write(&f, reinterpret_cast<char *>(data.data()), size), size);
+    assert_eq(f.off, offset + size);
+    assert_eq(reserved, 0);
+    assert_eq(memcmp(content.data() + offset, data.data(), size), 0);
+}
+
+void test_small_write()
+{
+    write_file(0, 100);
+    assert_eq(num_ops, 1);
+}
+
+void test_large_write()
+{
+    // a page at a time, this would take 256 ops.
+    constexpr usize size = 1 << 20;
+    write_file(0, size);
+    assert_eq(num_ops, (size + FILE_IOBUF_SIZE - 1) / FILE_IOBUF_SIZE);
+}
+
+void test_unaligned_write()
+{
+    constexpr usize size = 1 << 20;
+    write_file(100, size);
+    if (num_ops > (size + 100) / FILE_IOBUF_SIZE + 2)
+        throw AssertionFailure("unaligned write takes " + std::to_string(num_ops) + " ops");
+}
+
+} // namespace
+
+int main()
+{
+    bcache.begin_sized_op = begin_sized_op;
+    bcache.end_op = end_op;
+    inodes.lock = lock;
+    inodes.unlock = unlock;
+    inodes.write = write;
+
+    std::vector<Testcase> tests = {
+        { "small_write", test_small_write },
+        { "large_write", test_large_write },
+        { "unaligned_write", test_unaligned_write },
+    };
+    Runner(tests).run();
+
+    return 0;
+}
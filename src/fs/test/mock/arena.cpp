@@ -1,13 +1,20 @@
 extern "C" {
+#include <aarch64/mmu.h>
 #include <common/defines.h>
 }
 
 #include "map.hpp"
 
+#include <vector>
+
+// see `kernel/mem.h`, which C++ cannot include.
+using Shrinker = usize (*)(usize);
+
 namespace
 {
 Map<struct Arena *, usize> map;
 Map<u8 *, u8 *> ref;
+std::vector<Shrinker> shrinkers;
 } // namespace
 
 extern "C" {
@@ -21,4 +28,35 @@ void kfree(void *object)
 {
     free(object);
 }
+
+void *kalloc_page()
+{
+    return aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+}
+
+void kfree_page(void *page)
+{
+    free(page);
+}
+
+// the tests run as on a machine short of memory: caches stay at their least.
+u64 left_page_cnt()
+{
+    return 0;
+}
+
+void register_shrinker(Shrinker shrinker)
+{
+    shrinkers.push_back(shrinker);
+}
+
+usize shrink_caches(usize nr)
+{
+    usize freed = 0;
+    for (auto shrinker : shrinkers) {
+        if (freed < nr)
+            freed += shrinker(nr - freed);
+    }
+    return freed;
+}
 }
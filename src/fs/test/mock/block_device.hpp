@@ -1,6 +1,7 @@
 #pragma once
 
 extern "C" {
+#include <common/crc32c.h>
 #include <fs/cache.h>
 }
 
@@ -37,6 +38,7 @@ struct MockBlockDevice {
     std::atomic<bool> offline;
     std::atomic<usize> read_count;
     std::atomic<usize> write_count;
+    std::atomic<usize> request_count;  // calls of the device interface
     std::vector<Block> disk;
 
     using Hook = std::function<void(usize block_no, u8 *buffer)>;
@@ -50,6 +52,7 @@ struct MockBlockDevice {
         offline = false;
         read_count = 0;
         write_count = 0;
+        request_count = 0;
         {
             std::vector<Block> new_disk(sblock->num_blocks);
             std::swap(disk, new_disk);
@@ -59,7 +62,7 @@ struct MockBlockDevice {
             block.fill_junk();
         }
 
-        if (sblock->num_log_blocks < 2)
+        if (sblock->num_log_blocks < LOG_HEADER_BLOCKS + 1)
             throw Internal("logging area is too small");
         disk[sblock->log_start].fill_zero();
 
@@ -86,13 +89,29 @@ struct MockBlockDevice {
     }
 
     auto inspect_log(usize index) -> u8 * {
-        return inspect(sblock->log_start + 1 + index);
+        return inspect(sblock->log_start + LOG_HEADER_BLOCKS + index);
     }
 
+    // only the block numbers in the first header block can be accessed.
     auto inspect_log_header() -> LogHeader * {
         return reinterpret_cast<LogHeader *>(inspect(sblock->log_start));
     }
 
+    // set the checksums in the log header as the commits of the first
+    // `prev_blocks` and of all logged blocks would.
+    void seal_log(usize prev_blocks = 0) {
+        auto *header = inspect_log_header();
+        u32 crc = 0;
+        header->prev_blocks = prev_blocks;
+        header->prev_checksum = 0;
+        for (usize i = 0; i < header->num_blocks; i++) {
+            crc = crc32c(crc, inspect_log(i), BLOCK_SIZE);
+            if (i + 1 == prev_blocks)
+                header->prev_checksum = crc32c(crc, header->block_no, prev_blocks * sizeof(usize));
+        }
+        header->checksum = crc32c(crc, header->block_no, header->num_blocks * sizeof(usize));
+    }
+
     void dump(std::ostream &stream) {
         for (auto &block : disk) {
             std::scoped_lock lock(block.mutex);
@@ -7,30 +7,46 @@ static SuperBlock sblock;
 static BlockDevice device;
 
 static void stub_read(usize block_no, u8 *buffer) {
+    mock.request_count++;
     mock.read(block_no, buffer);
 }
 
 static void stub_write(usize block_no, u8 *buffer) {
+    mock.request_count++;
     mock.write(block_no, buffer);
 }
 
+static void stub_readv(usize block_no, u8 **buffers, usize n) {
+    mock.request_count++;
+    for (usize i = 0; i < n; i++)
+        mock.read(block_no + i, buffers[i]);
+}
+
+static void stub_writev(usize block_no, u8 **buffers, usize n) {
+    mock.request_count++;
+    for (usize i = 0; i < n; i++)
+        mock.write(block_no + i, buffers[i]);
+}
+
 static void initialize_mock(  //
     usize log_size,
     usize num_data_blocks,
     const std::string &image_path = "") {
     sblock.log_start = 2;
-    sblock.inode_start = sblock.log_start + 1 + log_size;
+    sblock.inode_start = sblock.log_start + LOG_HEADER_BLOCKS + log_size;
     sblock.bitmap_start = sblock.inode_start + 1;
     sblock.num_inodes = 1;
-    sblock.num_log_blocks = 1 + log_size;
+    sblock.num_log_blocks = LOG_HEADER_BLOCKS + log_size;
     sblock.num_data_blocks = num_data_blocks;
-    sblock.num_blocks = 1 + 1 + 1 + log_size + 1 +
+    sblock.num_blocks = 1 + 1 + LOG_HEADER_BLOCKS + log_size + 1 +
                         ((num_data_blocks + BIT_PER_BLOCK - 1) / BIT_PER_BLOCK) + num_data_blocks;
 
     mock.initialize(sblock);
 
     device.read = stub_read;
     device.write = stub_write;
+    device.readv = stub_readv;
+    device.writev = stub_writev;
 
     if (!image_path.empty())
         mock.load(image_path);
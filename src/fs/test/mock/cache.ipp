@@ -22,6 +22,11 @@ static void stub_free(OpContext *ctx, usize block_no) {
     mock.free(ctx, block_no);
 }
 
+static usize stub_alloc_near(OpContext *ctx, usize goal) {
+    (void)goal;
+    return stub_alloc(ctx);
+}
+
 static Block *stub_acquire(usize block_no) {
     return mock.acquire(block_no);
 }
@@ -41,9 +46,11 @@ static struct _Loader {
         cache.begin_op = stub_begin_op;
         cache.end_op = stub_end_op;
         cache.alloc = stub_alloc;
+        cache.alloc_near = stub_alloc_near;
         cache.free = stub_free;
         cache.acquire = stub_acquire;
         cache.release = stub_release;
         cache.sync = stub_sync;
+        cache.sync_data = stub_sync;
     }
 } _loader;
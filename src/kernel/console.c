@@ -4,6 +4,7 @@
 #include <driver/uart.h>
 #include <kernel/console.h>
 #include <kernel/sched.h>
+#include <kernel/uaccess.h>
 
 struct console cons;
 
@@ -24,26 +25,35 @@ void console_init() {
 })
 
 /**
- * console_write - write to uart from the console buffer.
+ * console_write - write to uart from the user buffer, a chunk at a time.
  * @ip: the pointer to the inode
- * @buf: the buffer
+ * @buf: the buffer in user memory
  * @n: number of bytes to write
  */
 isize console_write(Inode *ip, char *buf, isize n) {
     inodes.unlock(ip);
-    acquire_spinlock(&cons.lock);
-    for (isize i = 0; i < n; i++) {
-        putc(buf[i]);
+    char chunk[64];
+    isize i = 0;
+    usize left = 0;
+    while (i < n && !left) {
+        isize m = MIN(n - i, (isize)sizeof(chunk));
+        left = copy_from_user(chunk, buf + i, m);
+        m -= left;
+        acquire_spinlock(&cons.lock);
+        for (isize j = 0; j < m; j++) {
+            putc(chunk[j]);
+        }
+        release_spinlock(&cons.lock);
+        i += m;
     }
-    release_spinlock(&cons.lock);
     inodes.lock(ip);
-    return n;
+    return i > 0 ? i : -1;
 }
 
 /**
  * console_read - read to the destination from the buffer
  * @ip: the pointer to the inode
- * @dst: the destination
+ * @dst: the destination in user memory
  * @n: number of bytes to read
  */
 isize console_read(Inode *ip, char *dst, isize n) {
@@ -68,7 +78,15 @@ isize console_read(Inode *ip, char *dst, isize n) {
                 cons.read_idx--;
             break;
         }
-        *dst++ = c;
+        // a fault cannot sleep under the lock.
+        release_spinlock(&cons.lock);
+        bool copied = !copy_to_user(dst++, &(char){c}, 1);
+        acquire_spinlock(&cons.lock);
+        if (!copied) {
+            if (n == m)
+                m = n - 1;  // nothing read: return -1
+            break;
+        }
         --n;
         if (c == '\n')
             break;
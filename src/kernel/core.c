@@ -1,7 +1,10 @@
 #include <aarch64/intrinsic.h>
 #include <kernel/cpu.h>
+#include <kernel/ksm.h>
+#include <kernel/pagecache.h>
 #include <kernel/printk.h>
 #include <kernel/sched.h>
+#include <kernel/swap.h>
 #include <test/test.h>
 #include <driver/memlayout.h>
 
@@ -26,6 +29,9 @@ void trap_return(u64);
 
 NO_RETURN void kernel_entry() {
     init_filesystem();
+    init_pagecache();
+    init_swap();
+    init_ksm();
 
     printk("Hello world! (Core %lld)\n", cpuid());
     // proc_test();
@@ -84,6 +84,7 @@ void set_cpu_on()
     ASSERT(!_arch_disable_trap());
     extern PTEntries invalid_pt;
     arch_set_ttbr0(K2P(&invalid_pt));
+    arch_tlbi_vmalle1is();
     extern char exception_vector[];
     arch_set_vbar(exception_vector);
     arch_reset_esr();
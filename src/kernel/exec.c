@@ -5,16 +5,28 @@
 #include <fs/file.h>
 #include <fs/inode.h>
 #include <kernel/console.h>
+#include <kernel/ksm.h>
 #include <kernel/mem.h>
 #include <kernel/paging.h>
 #include <kernel/proc.h>
 #include <kernel/pt.h>
 #include <kernel/sched.h>
+#include <kernel/swap.h>
 #include <kernel/syscall.h>
 
 #define USERTOP (1 + ~KSPACE_MASK)  // 0x0001000000000000
 #define STACK_PAGE 32               // 128KB stack
 #define UPALIGN(x) (((x) + 0xf) & ~0xf)
+#define MAX_ARG 32
+
+// argv and envp copied in from the caller, they fill one page.
+typedef struct {
+    char *argv[MAX_ARG], *envp[MAX_ARG];
+    usize used;  // bytes used of `strs`
+    char strs[];
+} ExecArgs;
+
+#define EXEC_STRS_SIZE (PAGE_SIZE - sizeof(ExecArgs))
 
 extern int fdalloc(struct file *f);
 
@@ -87,7 +99,7 @@ static ALWAYS_INLINE bool load_elf(struct pgdir *pd, const char *path, Elf64_Ehd
             u64 pte_flag = PTE_USER_DATA;
             if (sec_flag == ST_TEXT)
                 pte_flag |= PTE_RO;
-            vmmap(pd, va0, p, pte_flag);
+            *get_pte(pd, va0, true) = K2P(p) | pte_flag;  // 新页的引用交给 PTE
 
             if (inodes.read(ip, (u8 *)p + va - va0, ph_off, sz) != sz) {
                 goto bad;
@@ -124,13 +136,49 @@ bad:
     return false;
 }
 
+/*
+ * Copy the NULL terminated user array of strings `uv` into `a`, pointers to
+ * the copies go to `out`. Return the count, or -1 if bad or too many.
+ */
+static isize copy_strings(ExecArgs *a, char *const *uv, char **out) {
+    isize count = 0;
+    while (uv) {
+        char *p;
+        if (copy_from_user(&p, &uv[count], sizeof(p)))
+            return -1;
+        if (p == NULL)
+            break;
+        usize room = EXEC_STRS_SIZE - a->used;
+        isize n = count < MAX_ARG ? strncpy_from_user(a->strs + a->used, p, room) : -1;
+        if (n < 0 || (usize)n == room)
+            return -1;
+        out[count++] = a->strs + a->used;
+        a->used += n + 1;
+    }
+    return count;
+}
+
 SpinLock exec_lock = {0};
 
 static SleepLock load_lock = {.lock = {0}, .val = 1, .sleeplist = {&load_lock.sleeplist, &load_lock.sleeplist}};
 
+/*
+ * `path` is a kernel string, `argv` and `envp` are the user's: they are
+ * copied in before the old address space goes away.
+ */
 int execve(const char *path, char *const argv[], char *const envp[]) {
+    ExecArgs *args = kalloc_page();
+    args->used = 0;
+    isize argc_ = copy_strings(args, argv, args->argv);
+    isize envc_ = argc_ < 0 ? -1 : copy_strings(args, envp, args->envp);
+    if (envc_ < 0) {
+        kfree_page(args);
+        return -1;
+    }
+
     struct pgdir *const pgdir = kalloc(sizeof(struct pgdir));
     if (pgdir == NULL) {
+        kfree_page(args);
         return -1;
     }
     init_pgdir(pgdir);
@@ -141,6 +189,7 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     if (!load_elf(pgdir, path, &elf)) {
         release_sleeplock(&load_lock);
         free_pgdir(pgdir);
+        kfree_page(args);
         return -1;
     }
     release_sleeplock(&load_lock);
@@ -150,7 +199,7 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     for (int i = 1; i <= STACK_PAGE; ++i) {
         void *p = kalloc_page();
         memset(p, 0, PAGE_SIZE);
-        vmmap(pgdir, sp - i * PAGE_SIZE, p, PTE_USER_DATA);
+        *get_pte(pgdir, sp - i * PAGE_SIZE, true) = K2P(p) | PTE_USER_DATA;
     }
     struct section *sec = kalloc(sizeof(struct section));
     memset(sec, 0, sizeof(struct section));
@@ -160,37 +209,28 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     _insert_into_list(&pgdir->section_head, &sec->stnode);
 
     {
-        u64 argc = 0, envc = 0;
-        if (envp)
-            while (envp[envc])
-                ++envc;
-        if (argv)
-            while (argv[argc])
-                ++argc;
+        u64 argc = argc_, envc = envc_;
+        char **argv = args->argv, **envp = args->envp;
         uint64_t newargv[argc + 1], newenvp[envc + 1];
 
         sp -= 16;
         copyout(pgdir, (void *)sp, 0, 8);
-        if (envp) {
-            for (int i = envc - 1; i >= 0; --i) {
-                sp -= strlen(envp[i]) + 1;
-                sp -= (u64)sp % 16;
-                copyout(pgdir, (void *)sp, envp[i], strlen(envp[i]) + 1);
-                newenvp[i] = sp;
-            }
+        for (int i = envc - 1; i >= 0; --i) {
+            sp -= strlen(envp[i]) + 1;
+            sp -= (u64)sp % 16;
+            copyout(pgdir, (void *)sp, envp[i], strlen(envp[i]) + 1);
+            newenvp[i] = sp;
         }
         newenvp[envc] = 0;
 
         sp -= 8;
         copyout(pgdir, (void *)sp, 0, 8);
 
-        if (argv) {
-            for (int i = argc - 1; i >= 0; --i) {
-                sp -= strlen(argv[i]) + 1;
-                sp -= (u64)sp % 16;
-                copyout(pgdir, (void *)sp, argv[i], strlen(argv[i]) + 1);
-                newargv[i] = sp;
-            }
+        for (int i = argc - 1; i >= 0; --i) {
+            sp -= strlen(argv[i]) + 1;
+            sp -= (u64)sp % 16;
+            copyout(pgdir, (void *)sp, argv[i], strlen(argv[i]) + 1);
+            newargv[i] = sp;
         }
         newargv[argc] = 0;
 
@@ -201,16 +241,19 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
         sp -= 8;
         copyout(pgdir, (void *)sp, &argc, sizeof(argc));
     }
+    kfree_page(args);
 
     Proc *curproc = thisproc();
+    free_sections(&curproc->pgdir);  // writes back and unlinks the shared mappings
     struct pgdir oldpd = curproc->pgdir;
     curproc->pgdir = *pgdir;
     _insert_into_list(&pgdir->section_head, &curproc->pgdir.section_head);
     _detach_from_list(&pgdir->section_head);
     curproc->ucontext->elr = elf.e_entry;
     curproc->ucontext->sp = (uint64_t)sp;
-    attach_pgdir(&curproc->pgdir);
-    arch_tlbi_vmalle1is();
+    attach_pgdir(&curproc->pgdir);  // gets a fresh ASID, no flush needed
+    swap_add_pgdir(&curproc->pgdir);
+    ksm_add_pgdir(&curproc->pgdir);
     free_pgdir(&oldpd);
 
     return 0;
@@ -0,0 +1,291 @@
+#include <common/bitmap.h>
+#include <common/list.h>
+#include <common/rbtree.h>
+#include <common/sem.h>
+#include <common/spinlock.h>
+#include <common/string.h>
+#include <driver/memlayout.h>
+#include <kernel/cpu.h>
+#include <kernel/ksm.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <kernel/proc.h>
+
+#ifdef DEBUG
+#define printk(fmt, ...) printk(fmt, ##__VA_ARGS__)
+#else
+#define printk(fmt, ...)
+#endif
+
+#define PTE(p) (PTEntry *)P2K(PTE_ADDRESS(p))
+#define NPAGES ((PHYSTOP - EXTMEM) / PAGE_SIZE)
+#define PAGE_NO(page) ((K2P(page) - EXTMEM) / PAGE_SIZE)
+
+// at most so many address spaces are visited per wakeup.
+#define KSM_MAX_BATCHES 16
+
+/*
+ * Two trees of pages ordered by (hash, content), only used by ksmd. The
+ * stable tree holds the shared read-only copies. The unstable tree holds
+ * the candidates seen in this pass; they stay writable, so their order may
+ * go stale, which only costs missed merges. The stable tree holds one
+ * reference of each page. The unstable one holds none, so that its pages
+ * still look private to everyone else: they may be freed or reused meanwhile,
+ * which again only costs missed merges, as they are only compared against.
+ * A candidate equal to an unstable page becomes a shared copy itself, and
+ * the other one merges into it when visited.
+ */
+typedef struct {
+    struct rb_node_ rb;
+    ListNode node;
+    u64 hash;
+    void *page;
+} KsmNode;
+
+static struct rb_root_ stable, unstable;
+static ListNode stable_list, unstable_list;
+static Bitmap(shared, NPAGES);  // pages in the stable tree
+
+/*
+ * Locking order: `list_lock`, then `pgdir.lock`.
+ */
+static SpinLock list_lock;  // protects `pgdirs` and `npgdirs`
+static ListNode pgdirs;     // candidate address spaces, in scan order
+static usize npgdirs;
+static usize pass_left;     // address spaces to finish before this pass ends
+
+static Semaphore ksmd_sem;
+static struct timer ksmd_timer;
+static bool ksm_run;
+static struct ksmstat ksm_stat;  // read by `ksm_get_stat` at any time
+
+#define STAT_INC(field) __atomic_fetch_add(&ksm_stat.field, 1, __ATOMIC_RELAXED)
+
+static bool ksm_cmp(rb_node lnode, rb_node rnode) {
+    KsmNode *l = container_of(lnode, KsmNode, rb), *r = container_of(rnode, KsmNode, rb);
+    if (l->hash != r->hash)
+        return l->hash < r->hash;
+    return memcmp(l->page, r->page, PAGE_SIZE) < 0;
+}
+
+// FNV-1a over the words of `page`.
+static u64 page_hash(void *page, bool *zero) {
+    u64 h = 0xcbf29ce484222325, any = 0;
+    for (u64 *w = page; w < (u64 *)(page + PAGE_SIZE); w++) {
+        h = (h ^ *w) * 0x100000001b3;
+        any |= *w;
+    }
+    *zero = any == 0;
+    return h;
+}
+
+typedef struct {
+    struct pgdir *pd;
+    u64 va;        // the next address to look at
+    usize budget;  // PTEs left to look at
+} Scan;
+
+// map `page` read-only at `*pte` in place of its own page.
+static void merge_into(Scan *s, PTEntry *pte, u64 va, void *page) {
+    void *old = (void *)P2K(PTE_ADDRESS(*pte));
+    rc(page)++;
+    *pte = K2P(page) | PTE_FLAGS(*pte) | PTE_RO;
+    flush_tlb_page(s->pd, va);
+    kfree_page(old);
+    STAT_INC(pages_merged);
+}
+
+/*
+ * Only private pages nobody else maps are candidates. The PTE is made
+ * read-only before looking at the page: a write from now on faults, and
+ * the copy on write waits for the pgdir lock we hold.
+ */
+static void scan_pte(Scan *s, PTEntry *pte, u64 va) {
+    PTEntry e = *pte;
+    void *page = (void *)P2K(PTE_ADDRESS(e));
+    if (!(e & PTE_VALID) || !(e & PTE_USER) || (e & PTE_CONT) || rc(page) != 1)
+        return;
+    if (!(e & PTE_RO)) {
+        *pte = e | PTE_RO;
+        flush_tlb_page(s->pd, va);
+    }
+
+    bool zero;
+    KsmNode key = {.hash = page_hash(page, &zero), .page = page};
+    if (zero) {
+        merge_into(s, pte, va, get_zero_page());
+        return;
+    }
+    rb_node found = _rb_lookup(&key.rb, &stable, ksm_cmp);
+    if (found) {
+        merge_into(s, pte, va, container_of(found, KsmNode, rb)->page);
+        STAT_INC(pages_sharing);
+        return;
+    }
+
+    KsmNode *n = kalloc(sizeof(KsmNode));
+    n->hash = key.hash;
+    n->page = page;
+    if (_rb_lookup(&key.rb, &unstable, ksm_cmp)) {  // stays read-only
+        rc(page)++;
+        ASSERT(_rb_insert(&n->rb, &stable, ksm_cmp) == 0);
+        _insert_into_list(&stable_list, &n->node);
+        bitmap_set(shared, PAGE_NO(page));
+        STAT_INC(pages_shared);
+        printk("ksmd: page %p shared\n", page);
+        return;
+    }
+    *pte = e;
+    if (_rb_insert(&n->rb, &unstable, ksm_cmp) == 0)
+        _insert_into_list(&unstable_list, &n->node);
+    else
+        kfree(n);
+}
+
+// walk `table` at `level` (0 to 3) from `s->va`. return true to stop.
+static bool scan_table(Scan *s, PTEntriesPtr table, int level, u64 base) {
+    int shift = 39 - 9 * level;
+    usize i = s->va > base ? (s->va - base) >> shift : 0;
+    for (; i < N_PTE_PER_TABLE; i++) {
+        u64 va = base + ((u64)i << shift);
+        s->va = va + (1ull << shift);
+        if (level == 3) {
+            scan_pte(s, &table[i], va);
+            if (--s->budget == 0)
+                return true;
+        } else if ((table[i] & PTE_TABLE) == PTE_TABLE) {
+            if (scan_table(s, PTE(table[i]), level + 1, va))
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * At the end of a pass the unstable tree is dropped, and so are the shared
+ * copies nobody maps any more.
+ */
+static void end_pass() {
+    while (!_empty_list(&unstable_list)) {
+        KsmNode *n = container_of(unstable_list.next, KsmNode, node);
+        _detach_from_list(&n->node);
+        kfree(n);
+    }
+    unstable.rb_node = NULL;
+
+    u64 nshared = 0, nsharing = 0;
+    for (ListNode *p = stable_list.next, *next; p != &stable_list; p = next) {
+        next = p->next;
+        KsmNode *n = container_of(p, KsmNode, node);
+        if (rc(n->page) > 1) {
+            nshared++;
+            nsharing += rc(n->page) - 2;
+            continue;
+        }
+        _rb_erase(&n->rb, &stable);
+        _detach_from_list(&n->node);
+        bitmap_clear(shared, PAGE_NO(n->page));
+        kfree_page(n->page);
+        kfree(n);
+    }
+    __atomic_store_n(&ksm_stat.pages_shared, nshared, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_stat.pages_sharing, nsharing, __ATOMIC_RELAXED);
+    STAT_INC(full_scans);
+}
+
+// scan the next address space with `*budget` PTEs. return false if there is none.
+static bool ksm_batch(usize *budget) {
+    acquire_spinlock(&list_lock);
+    if (_empty_list(&pgdirs)) {
+        release_spinlock(&list_lock);
+        return false;
+    }
+    struct pgdir *pd = container_of(pgdirs.next, struct pgdir, ksmnode);
+    _detach_from_list(&pd->ksmnode);
+    _insert_into_list(pgdirs.prev, &pd->ksmnode);
+    pass_left = MIN(pass_left, npgdirs);
+    acquire_spinlock(&pd->lock);
+    release_spinlock(&list_lock);
+
+    Scan s = {.pd = pd, .va = pd->ksm_hand, .budget = *budget};
+    bool stopped = pd->pt && scan_table(&s, pd->pt, 0, 0);
+    pd->ksm_hand = stopped ? s.va : 0;
+    release_spinlock(&pd->lock);
+    *budget = s.budget;
+
+    if (!stopped && (pass_left == 0 || --pass_left == 0)) {
+        end_pass();
+        acquire_spinlock(&list_lock);
+        pass_left = npgdirs;
+        release_spinlock(&list_lock);
+    }
+    return true;
+}
+
+static NO_RETURN void ksmd(u64 arg) {
+    (void)arg;
+    while (true) {
+        // the timer stays armed on the CPU that set it until it fires.
+        if (__atomic_load_n(&ksm_run, __ATOMIC_ACQUIRE) && ksmd_timer.triggered)
+            set_cpu_timer(&ksmd_timer);
+        unalertable_wait_sem(&ksmd_sem);
+        if (!__atomic_load_n(&ksm_run, __ATOMIC_ACQUIRE))
+            continue;
+        usize budget = KSM_SCAN_BUDGET;
+        for (int i = 0; i < KSM_MAX_BATCHES && budget > 0 && ksm_batch(&budget); i++)
+            ;
+    }
+}
+
+static void ksmd_timer_handler(struct timer *t) {
+    (void)t;
+    post_sem(&ksmd_sem);
+}
+
+void ksm_add_pgdir(struct pgdir *pd) {
+    pd->ksm_hand = 0;
+    acquire_spinlock(&list_lock);
+    _insert_into_list(pgdirs.prev, &pd->ksmnode);
+    npgdirs++;
+    release_spinlock(&list_lock);
+}
+
+void ksm_remove_pgdir(struct pgdir *pd) {
+    acquire_spinlock(&list_lock);
+    if (_detach_from_list(&pd->ksmnode))  // it may never have been added
+        npgdirs--;
+    release_spinlock(&list_lock);
+    // wait for a scan of `pd` in progress.
+    acquire_spinlock(&pd->lock);
+    release_spinlock(&pd->lock);
+}
+
+void ksm_cow_break(void *page) {
+    if (bitmap_get(shared, PAGE_NO(page)))
+        STAT_INC(pages_unmerged);
+}
+
+void ksm_set_run(bool run) {
+    if (!__atomic_exchange_n(&ksm_run, run, __ATOMIC_ACQ_REL) && run)
+        post_sem(&ksmd_sem);
+}
+
+void ksm_get_stat(struct ksmstat *st) {
+    st->pages_shared = __atomic_load_n(&ksm_stat.pages_shared, __ATOMIC_RELAXED);
+    st->pages_sharing = __atomic_load_n(&ksm_stat.pages_sharing, __ATOMIC_RELAXED);
+    st->pages_merged = __atomic_load_n(&ksm_stat.pages_merged, __ATOMIC_RELAXED);
+    st->pages_unmerged = __atomic_load_n(&ksm_stat.pages_unmerged, __ATOMIC_RELAXED);
+    st->full_scans = __atomic_load_n(&ksm_stat.full_scans, __ATOMIC_RELAXED);
+}
+
+void init_ksm() {
+    init_spinlock(&list_lock);
+    init_list_node(&pgdirs);
+    init_list_node(&stable_list);
+    init_list_node(&unstable_list);
+    init_sem(&ksmd_sem, 0);
+    ksmd_timer.triggered = true;
+    ksmd_timer.elapse = KSM_SCAN_INTERVAL_MS;
+    ksmd_timer.handler = ksmd_timer_handler;
+    start_proc(create_proc(), ksmd, 0);
+}
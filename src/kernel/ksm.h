@@ -0,0 +1,45 @@
+#pragma once
+
+#include <common/defines.h>
+#include <kernel/pt.h>
+
+/**
+    @brief the merging scanner (ksmd) looks for private pages with the same
+    content and maps a single read-only copy in their place. A write breaks
+    the sharing again through copy on write. Pages of zeros are merged into
+    the zero page.
+
+    It is off until turned on by the `ksm` syscall. When on, it visits so
+    many PTEs every so many milliseconds.
+ */
+#define KSM_SCAN_INTERVAL_MS 100
+#define KSM_SCAN_BUDGET 1024
+
+struct ksmstat {
+    u64 pages_shared;   // shared copies kept by ksmd
+    u64 pages_sharing;  // mappings of them beyond the first one: pages saved
+    u64 pages_merged;   // pages merged since boot, including into the zero page
+    u64 pages_unmerged; // writes to shared copies since boot
+    u64 full_scans;     // passes over all address spaces
+};
+
+void init_ksm();
+
+/**
+    @brief make the pages of `pd` candidates for merging / stop it. `pd`
+    must be removed before its page table is torn down.
+ */
+void ksm_add_pgdir(struct pgdir *pd);
+void ksm_remove_pgdir(struct pgdir *pd);
+
+/**
+    @brief note that a write to `page` is about to copy it.
+ */
+void ksm_cow_break(void *page);
+
+/**
+    @brief turn ksmd on or off.
+ */
+void ksm_set_run(bool run);
+
+void ksm_get_stat(struct ksmstat *st);
@@ -3,6 +3,7 @@
 #include <common/spinlock.h>
 #include <driver/memlayout.h>
 #include <kernel/mem.h>
+#include <kernel/swap.h>
 
 #include <common/list.h>
 #include <common/string.h>
@@ -22,6 +23,45 @@ static SpinLock page_lock = {0};
 static ListNode list = {&list, &list};  // deleted pages.
 static char *mm_end;                    // lowest allocated page address
 
+/*
+ * A 2 MiB block whose pages are all in `list` is moved to `huge_list` as a
+ * whole, so that `kalloc_huge` finds it. `kalloc_page` only breaks such a
+ * block up when `list` is empty. Both are protected by `page_lock`.
+ */
+#define NUM_HUGE ((PHYSTOP - EXTMEM) / HUGE_PAGE_SIZE)
+#define HUGE_NO(p) ((K2P(p) - EXTMEM) / HUGE_PAGE_SIZE)
+static ListNode huge_list = {&huge_list, &huge_list};  // free blocks.
+static u16 num_free[NUM_HUGE];  // pages of each block in `list`
+
+static void push_page(void *p) {
+    _insert_into_list(&list, (ListNode *)p);
+    usize h = HUGE_NO(p);
+    if (++num_free[h] < N_PTE_PER_TABLE)
+        return;
+    char *base = (char *)HUGE_BASE(p);
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        _detach_from_list((ListNode *)(base + i * PAGE_SIZE));
+    num_free[h] = 0;
+    _insert_into_list(&huge_list, (ListNode *)base);
+}
+
+static void *pop_page() {
+    if (!_empty_list(&list)) {
+        ListNode *p = list.next;
+        _detach_from_list(p);
+        num_free[HUGE_NO(p)]--;
+        return p;
+    }
+    if (!_empty_list(&huge_list)) {
+        char *base = (char *)huge_list.next;
+        _detach_from_list((ListNode *)base);
+        for (int i = 1; i < N_PTE_PER_TABLE; i++)
+            push_page(base + i * PAGE_SIZE);
+        return base;
+    }
+    return mm_end += PAGE_SIZE;
+}
+
 u64 endp;
 static int pagenum;  // total number of pages. avoid re-calculating.
 static char *zero;
@@ -34,6 +74,7 @@ void kinit() {
     init_rc(&kalloc_page_cnt);
     init_spinlock(&page_lock);
     init_list_node(&list);
+    init_list_node(&huge_list);
 
     extern char end[];
 
@@ -62,17 +103,44 @@ void *kalloc_page() {
 
     acquire_spinlock(&page_lock);
 
-    void *ret = NULL;
-    if (_empty_list(&list)) {
-        ret = mm_end += PAGE_SIZE;
+    void *ret = pop_page();
+    rc(ret) = 1;
+
+    release_spinlock(&page_lock);
+
+    if (left_page_cnt() < LOW_WATERMARK_PAGES)
+        wakeup_kswapd();
+    return ret;
+}
+
+void *kalloc_huge() {
+    acquire_spinlock(&page_lock);
+
+    char *ret;
+    if (!_empty_list(&huge_list)) {
+        ret = (char *)huge_list.next;
+        _detach_from_list((ListNode *)ret);
     } else {
-        ret = list.next;
-        _detach_from_list(list.next);
+        // otherwise only memory never handed out is contiguous enough.
+        ret = (char *)P2K(round_up(K2P(mm_end + PAGE_SIZE), HUGE_PAGE_SIZE));
+        if (ret + HUGE_PAGE_SIZE > (char *)P2K(PHYSTOP)) {
+            release_spinlock(&page_lock);
+            return NULL;
+        }
+        // the pages skipped for alignment are free pages.
+        for (char *p = mm_end + PAGE_SIZE; p < ret; p += PAGE_SIZE)
+            push_page(p);
+        mm_end = ret + HUGE_PAGE_SIZE - PAGE_SIZE;
     }
 
-    rc(ret) = 1;
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        rc(ret + i * PAGE_SIZE) = 1;
+    __atomic_fetch_add(&kalloc_page_cnt.count, N_PTE_PER_TABLE, __ATOMIC_ACQ_REL);
 
     release_spinlock(&page_lock);
+
+    if (left_page_cnt() < LOW_WATERMARK_PAGES)
+        wakeup_kswapd();
     return ret;
 }
 
@@ -87,8 +155,23 @@ void kfree_page(void *p) {
     /*  if (p == mm_end)
             mm_end -= PAGE_SIZE;
         else  */
-    _insert_into_list(&list, p);
+    push_page(p);
+
+    release_spinlock(&page_lock);
+}
+
+void kfree_pages(void **pages, usize n) {
+    usize nfree = 0;
+    for (usize i = 0; i < n; i++)
+        if (--rc(pages[i]) == 0)
+            pages[nfree++] = pages[i];
+    if (nfree == 0)
+        return;
+    __atomic_sub_fetch(&kalloc_page_cnt.count, nfree, __ATOMIC_ACQ_REL);
 
+    acquire_spinlock(&page_lock);
+    for (usize i = 0; i < nfree; i++)
+        push_page(pages[i]);
     release_spinlock(&page_lock);
 }
 
@@ -163,6 +246,27 @@ void kfree(void *ptr) {
 void *get_zero_page() {
     return zero;
 }
+
+#define MAX_SHRINKERS 8
+static Shrinker shrinkers[MAX_SHRINKERS];
+static int nshrinkers;
+
+void register_shrinker(Shrinker shrinker) {
+    acquire_spinlock(&page_lock);
+    ASSERT(nshrinkers < MAX_SHRINKERS);
+    shrinkers[nshrinkers] = shrinker;
+    __atomic_store_n(&nshrinkers, nshrinkers + 1, __ATOMIC_RELEASE);
+    release_spinlock(&page_lock);
+}
+
+usize shrink_caches(usize nr) {
+    usize freed = 0;
+    int n = __atomic_load_n(&nshrinkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && freed < nr; i++)
+        freed += shrinkers[i](nr - freed);
+    printk("shrink_caches: %lld of %lld pages freed\n", freed, nr);
+    return freed;
+}
 typedef struct {
     u64 npages;
 } PageHeader;
@@ -202,7 +306,7 @@ void kfree_large(void *p) {
 
     for (int i = 0; i < npages; i++) {
         void *page = (char*)header + i * PAGE_SIZE;
-        _insert_into_list(&list, page);
+        push_page(page);
     }
     __atomic_sub_fetch(&kalloc_page_cnt.count, npages, __ATOMIC_ACQ_REL);
 
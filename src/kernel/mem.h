@@ -16,11 +16,39 @@ u64 left_page_cnt();
 WARN_RESULT void *kalloc_page();
 void kfree_page(void *);
 
+/**
+ * Like `kfree_page` on each of `pages`, but the free ones are returned to the
+ * allocator at once. `pages` is clobbered.
+ */
+void kfree_pages(void **pages, usize n);
+
+/**
+ * Allocate HUGE_PAGE_SIZE bytes aligned to it. The pages in it are ordinary
+ * pages, each with a reference, to be freed one by one with `kfree_page`.
+ * Once all pages of an aligned block are free again, it can be allocated
+ * as a whole again. Return NULL if there is no such memory left.
+ */
+WARN_RESULT void *kalloc_huge();
+
 WARN_RESULT void *kalloc(unsigned long long);
 void kfree(void *);
 
 WARN_RESULT void *get_zero_page();
 
+/**
+ * A shrinker frees about `nr` pages of a cache that can be rebuilt, and
+ * returns how many pages it freed. Shrinkers are run by the reclaimer when
+ * free pages run low, before anything is swapped out; never from
+ * `kalloc_page`, so they may take the locks of their caches.
+ */
+typedef usize (*Shrinker)(usize nr);
+void register_shrinker(Shrinker shrinker);
+
+/**
+ * Run the shrinkers until `nr` pages are freed. Return how many were.
+ */
+usize shrink_caches(usize nr);
+
 extern u64 endp;
 extern _Atomic unsigned *refcnt;  // this ptr is only set once on kinit.
 #define rc(page) refcnt[((u64)(page) - endp) / PAGE_SIZE]
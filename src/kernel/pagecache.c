@@ -0,0 +1,441 @@
+#include <common/sem.h>
+#include <common/spinlock.h>
+#include <common/string.h>
+#include <fs/cache.h>
+#include <kernel/cpu.h>
+#include <kernel/mem.h>
+#include <kernel/pagecache.h>
+#include <kernel/paging.h>
+#include <kernel/printk.h>
+#include <kernel/proc.h>
+#include <kernel/pt.h>
+
+#ifdef DEBUG
+#define printk(fmt, ...) printk(fmt, ##__VA_ARGS__)
+#else
+#define printk(fmt, ...)
+#endif
+
+static SpinLock lock;   // protects every page tree and mapping list, and the below
+static ListNode lru;    // all cached pages, most recently used first
+static ListNode dirty;  // dirty pages, most recently dirtied first
+static usize num_pages;
+
+static void update_mappings(CachedPage *cp, bool unmap);
+
+// caller must hold `lock`.
+static void drop(CachedPage *cp) {
+    ASSERT(radix_tree_delete(&cp->inode->pages, cp->index) == cp);
+    _detach_from_list(&cp->lru);
+    if (cp->is_dirty)
+        _detach_from_list(&cp->dirty);
+    num_pages--;
+    kfree_page(cp->page);
+    kfree(cp);
+}
+
+/*
+ * Drop up to `nr` of the least recently used clean pages that nobody maps,
+ * and return how many. The pages skipped move to the head, so that the next
+ * scan does not look at them again. caller must hold `lock`.
+ */
+static usize evict(usize nr) {
+    usize freed = 0;
+    for (usize n = num_pages; n > 0 && freed < nr; n--) {
+        CachedPage *cp = container_of(lru.prev, CachedPage, lru);
+        if (rc(cp->page) == 1 && !cp->is_dirty) {
+            drop(cp);
+            freed++;
+        } else {
+            _detach_from_list(&cp->lru);
+            _insert_into_list(&lru, &cp->lru);
+        }
+    }
+    return freed;
+}
+
+// the shrinker of the page cache, see `register_shrinker`.
+static usize pagecache_shrink(usize nr) {
+    acquire_spinlock(&lock);
+    usize freed = evict(nr);
+    release_spinlock(&lock);
+    return freed;
+}
+
+void *pagecache_lookup(Inode *inode, usize index) {
+    void *page = NULL;
+    acquire_spinlock(&lock);
+    CachedPage *cp = radix_tree_lookup(&inode->pages, index);
+    if (cp) {
+        _detach_from_list(&cp->lru);
+        _insert_into_list(&lru, &cp->lru);
+        page = cp->page;
+        rc(page)++;
+    }
+    release_spinlock(&lock);
+    return page;
+}
+
+// read page `index` into the cache. caller must hold the lock of `inode`.
+static void *fill(Inode *inode, usize index) {
+    void *page = pagecache_lookup(inode, index);
+    if (page)
+        return page;
+
+    page = kalloc_page();
+    usize offset = index * PAGE_SIZE, n = 0;
+    if (offset < inode->entry.num_bytes)
+        n = inodes.read(inode, page, offset, PAGE_SIZE);
+    memset(page + n, 0, PAGE_SIZE - n);
+
+    CachedPage *cp = kalloc(sizeof(CachedPage));
+    cp->inode = inode;
+    cp->index = index;
+    cp->page = page;
+    cp->is_dirty = false;
+    rc(page)++;
+
+    acquire_spinlock(&lock);
+    ASSERT(radix_tree_insert(&inode->pages, index, cp));
+    _insert_into_list(&lru, &cp->lru);
+    if (++num_pages > PAGECACHE_MAX_PAGES)
+        evict(num_pages - PAGECACHE_MAX_PAGES);
+    release_spinlock(&lock);
+    return page;
+}
+
+void *pagecache_get(Inode *inode, usize index) {
+    void *page = pagecache_lookup(inode, index);
+    if (page)
+        return page;
+    inodes.lock(inode);
+    page = fill(inode, index);
+    inodes.unlock(inode);
+    return page;
+}
+
+void pagecache_update(Inode *inode, const u8 *src, usize offset, usize count) {
+    if (!inode->pages.root)
+        return;
+    for (usize end = offset + count; offset < end;) {
+        usize n = MIN(end - offset, PAGE_SIZE - offset % PAGE_SIZE);
+        void *page = pagecache_lookup(inode, offset / PAGE_SIZE);
+        if (page) {
+            u8 *dest = page + offset % PAGE_SIZE;
+            if (dest != src)  // not written back from the page itself
+                memcpy(dest, src, n);
+            kfree_page(page);
+        }
+        src += n;
+        offset += n;
+    }
+}
+
+void pagecache_invalidate(Inode *inode, usize offset, usize count) {
+    if (count == 0)
+        return;
+    usize first = offset / PAGE_SIZE;
+    usize last = (offset + MIN(count, ~offset) - 1) / PAGE_SIZE;
+    acquire_spinlock(&lock);
+    CachedPage *cps[16];
+    usize n;
+    while ((n = radix_tree_gang_lookup(&inode->pages, first, (void **)cps, 16))) {
+        usize next = cps[n - 1]->index + 1;
+        for (usize i = 0; i < n && cps[i]->index <= last; i++) {
+            // shared mappings fault the page in again, fresh from the file.
+            update_mappings(cps[i], true);
+            drop(cps[i]);
+        }
+        if (next > last)
+            break;
+        first = next;
+    }
+    release_spinlock(&lock);
+}
+
+// caller must hold `lock`.
+static void mark_dirty(CachedPage *cp) {
+    if (!cp->is_dirty) {
+        cp->is_dirty = true;
+        _insert_into_list(&dirty, &cp->dirty);
+    }
+}
+
+bool pagecache_map(Inode *inode, usize index, void *page, PTEntry *pte, u64 flags) {
+    acquire_spinlock(&lock);
+    CachedPage *cp = radix_tree_lookup(&inode->pages, index);
+    bool cached = cp && cp->page == page;
+    if (cached) {
+        if (!(flags & PTE_RO))
+            mark_dirty(cp);
+        *pte = K2P(page) | flags;
+    }
+    release_spinlock(&lock);
+    return cached;
+}
+
+bool pagecache_set_dirty(Inode *inode, usize index, PTEntry *pte) {
+    acquire_spinlock(&lock);
+    CachedPage *cp = radix_tree_lookup(&inode->pages, index);
+    bool cached = cp && K2P(cp->page) == PTE_ADDRESS(*pte);
+    if (cached) {
+        mark_dirty(cp);
+        *pte &= ~PTE_RO;
+    }
+    release_spinlock(&lock);
+    return cached;
+}
+
+/*
+ * Make every shared mapping of `cp` read-only, so that the next write to it
+ * faults and marks it dirty again, or unmap it if `unmap`. A PTE is only
+ * changed if it still maps the page, under the lock of its address space,
+ * which its owner holds to unmap or free page tables. A section stays in
+ * the mapping list, and so its address space alive, while we hold `lock`.
+ * Locking order: `lock`, then `pgdir.lock`.
+ */
+static void update_mappings(CachedPage *cp, bool unmap) {
+    u64 pos = cp->index * PAGE_SIZE;
+    ListNode *head = &cp->inode->mappings;
+    for (ListNode *p = head->next; p != head; p = p->next) {
+        struct section *sec = container_of(p, struct section, mapnode);
+        if (pos < sec->offset || pos - sec->offset >= sec->end - sec->begin)
+            continue;
+        u64 va = sec->begin + (pos - sec->offset);
+        acquire_spinlock(&sec->pgdir->lock);
+        PTEntry *pte = get_pte(sec->pgdir, va, false);
+        PTEntry old = pte ? *pte : 0;
+        if ((old & PTE_VALID) && PTE_ADDRESS(old) == K2P(cp->page)) {
+            if (unmap) {
+                *pte = 0;
+                flush_tlb_page(sec->pgdir, va);
+                kfree_page(cp->page);  // the reference of the mapping
+            } else if (!(old & PTE_RO)) {
+                // the fault path sets the PTE without the lock, see `pagecache_set_dirty`.
+                if (__atomic_compare_exchange_n(pte, &old, old | PTE_RO, false,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                    flush_tlb_page(sec->pgdir, va);
+            }
+        }
+        release_spinlock(&sec->pgdir->lock);
+    }
+}
+
+/*
+ * One transaction covers a whole page: the blocks are already allocated, so
+ * only the data blocks themselves are logged.
+ */
+#define WRITEBACK_CHUNK ((usize)(OP_MAX_NUM_BLOCKS - 2) * BLOCK_SIZE)
+
+void pagecache_writeback(Inode *inode, usize index) {
+    // clean the page first: a write from now on dirties it again.
+    acquire_spinlock(&lock);
+    CachedPage *cp = radix_tree_lookup(&inode->pages, index);
+    if (!cp || !cp->is_dirty) {
+        release_spinlock(&lock);
+        return;
+    }
+    cp->is_dirty = false;
+    _detach_from_list(&cp->dirty);
+    update_mappings(cp, false);
+    void *page = cp->page;
+    rc(page)++;
+    release_spinlock(&lock);
+
+    usize offset = index * PAGE_SIZE;
+    for (usize done = 0; done < PAGE_SIZE;) {
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        inodes.lock(inode);
+        usize size = inode->entry.num_bytes, n = 0;
+        if (offset + done < size) {
+            n = MIN(WRITEBACK_CHUNK, MIN(PAGE_SIZE - done, size - offset - done));
+            inodes.write(&ctx, inode, page + done, offset + done, n);
+        }
+        inodes.unlock(inode);
+        bcache.end_op(&ctx);
+        if (n == 0)
+            break;
+        done += n;
+    }
+    kfree_page(page);
+}
+
+void pagecache_sync(Inode *inode, usize first, usize last) {
+    CachedPage *cps[16];
+    usize dirty_index[16];
+    while (first <= last) {
+        // collect a batch of dirty pages, then write them without the lock.
+        usize n, m = 0;
+        acquire_spinlock(&lock);
+        n = radix_tree_gang_lookup(&inode->pages, first, (void **)cps, 16);
+        for (usize i = 0; i < n && cps[i]->index <= last; i++) {
+            if (cps[i]->is_dirty)
+                dirty_index[m++] = cps[i]->index;
+        }
+        if (n)
+            first = cps[n - 1]->index + 1;
+        release_spinlock(&lock);
+
+        for (usize i = 0; i < m; i++)
+            pagecache_writeback(inode, dirty_index[i]);
+        if (n < 16 || first == 0)
+            break;
+    }
+}
+
+void pagecache_add_mapping(struct section *sec) {
+    acquire_spinlock(&lock);
+    _insert_into_list(&sec->fp->ip->mappings, &sec->mapnode);
+    release_spinlock(&lock);
+}
+
+void pagecache_remove_mapping(struct section *sec) {
+    acquire_spinlock(&lock);
+    _detach_from_list(&sec->mapnode);
+    release_spinlock(&lock);
+}
+
+/*
+ * The writeback thread wakes up every WRITEBACK_INTERVAL_MS, or when kicked
+ * by `msync(MS_ASYNC)` or memory pressure, and writes back the pages that
+ * were dirty at that time, oldest first.
+ */
+static Semaphore wb_sem;
+static struct timer wb_timer;
+static bool wb_kicked;
+
+void pagecache_kick_writeback() {
+    if (!__atomic_exchange_n(&wb_kicked, true, __ATOMIC_ACQ_REL))
+        post_sem(&wb_sem);
+}
+
+static void wb_timer_handler(struct timer *t) {
+    (void)t;
+    pagecache_kick_writeback();
+}
+
+static void writeback_all() {
+    usize count = 0;
+    acquire_spinlock(&lock);
+    for (ListNode *p = dirty.next; p != &dirty; p = p->next)
+        count++;
+    release_spinlock(&lock);
+
+    for (; count > 0; count--) {
+        acquire_spinlock(&lock);
+        if (_empty_list(&dirty)) {
+            release_spinlock(&lock);
+            break;
+        }
+        // a dirty page is mapped by someone, whose file holds the inode.
+        CachedPage *cp = container_of(dirty.prev, CachedPage, dirty);
+        Inode *inode = inodes.share(cp->inode);
+        usize index = cp->index;
+        release_spinlock(&lock);
+
+        pagecache_writeback(inode, index);
+
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        inodes.put(&ctx, inode);
+        bcache.end_op(&ctx);
+    }
+}
+
+static NO_RETURN void writeback_thread(u64 arg) {
+    (void)arg;
+    while (true) {
+        // the timer stays armed on the CPU that set it until it fires.
+        if (wb_timer.triggered)
+            set_cpu_timer(&wb_timer);
+        unalertable_wait_sem(&wb_sem);
+        __atomic_store_n(&wb_kicked, false, __ATOMIC_RELEASE);
+        printk("writeback: woken up\n");
+        writeback_all();
+    }
+}
+
+/*
+ * Readahead requests are served by a kernel thread, so that the faulting
+ * (or reading, for blocks) process keeps running while the next window is
+ * read.
+ */
+#define RA_QUEUE_SIZE 32
+
+static struct {
+    Inode *inode;
+    usize index, count;
+    bool blocks;  // blocks into the block cache, not pages
+} ra_queue[RA_QUEUE_SIZE];
+static usize ra_head, ra_tail;  // [ra_head, ra_tail) are pending
+static SpinLock ra_lock;
+static Semaphore ra_sem;
+
+static void queue_readahead(Inode *inode, usize index, usize count, bool blocks) {
+    acquire_spinlock(&ra_lock);
+    if (ra_tail - ra_head < RA_QUEUE_SIZE) {
+        usize i = ra_tail++ % RA_QUEUE_SIZE;
+        ra_queue[i].inode = inodes.share(inode);
+        ra_queue[i].index = index;
+        ra_queue[i].count = count;
+        ra_queue[i].blocks = blocks;
+        post_sem(&ra_sem);
+    }
+    release_spinlock(&ra_lock);
+}
+
+void pagecache_readahead(Inode *inode, usize index, usize count) {
+    queue_readahead(inode, index, count, false);
+}
+
+void pagecache_readahead_blocks(Inode *inode, usize index, usize count) {
+    queue_readahead(inode, index, count, true);
+}
+
+static NO_RETURN void readahead_thread(u64 arg) {
+    (void)arg;
+    while (true) {
+        unalertable_wait_sem(&ra_sem);
+        acquire_spinlock(&ra_lock);
+        usize i = ra_head++ % RA_QUEUE_SIZE;
+        Inode *inode = ra_queue[i].inode;
+        usize index = ra_queue[i].index, count = ra_queue[i].count;
+        bool blocks = ra_queue[i].blocks;
+        release_spinlock(&ra_lock);
+
+        printk("readahead: inode %lld, %s [%lld, %lld)\n", inode->inode_no,
+               blocks ? "blocks" : "pages", index, index + count);
+        if (blocks) {
+            inodes.readahead(inode, index, count);
+        } else {
+            inodes.lock(inode);
+            usize end = MIN(index + count,
+                            (inode->entry.num_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+            for (; index < end; index++)
+                kfree_page(fill(inode, index));
+            inodes.unlock(inode);
+        }
+
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        inodes.put(&ctx, inode);
+        bcache.end_op(&ctx);
+    }
+}
+
+void init_pagecache() {
+    init_spinlock(&lock);
+    init_list_node(&lru);
+    init_list_node(&dirty);
+    register_shrinker(pagecache_shrink);
+    init_spinlock(&ra_lock);
+    init_sem(&ra_sem, 0);
+    start_proc(create_proc(), readahead_thread, 0);
+
+    init_sem(&wb_sem, 0);
+    wb_timer.triggered = true;
+    wb_timer.elapse = WRITEBACK_INTERVAL_MS;
+    wb_timer.handler = wb_timer_handler;
+    start_proc(create_proc(), writeback_thread, 0);
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <aarch64/mmu.h>
+#include <common/defines.h>
+#include <common/list.h>
+#include <fs/inode.h>
+
+struct section;
+
+/**
+    @brief a file page kept in memory, see `Inode.pages`.
+
+    There is at most one page for each page of a file. `read` and `write` of
+    the inode go through it and shared mappings map it, so everyone sees the
+    same data.
+
+    The page cache holds one reference (`rc`) of `page`. Everyone who maps or
+    otherwise keeps the page must take their own.
+
+    Shared mappings map a clean page read-only. The first write faults and
+    marks the page dirty (see `pagecache_set_dirty`); writing it back makes
+    the mappings read-only again. So only dirtied pages are ever written.
+ */
+typedef struct {
+    ListNode lru;      // in the global LRU list
+    ListNode dirty;    // in the global dirty list, if `is_dirty`
+    Inode *inode;
+    usize index;       // page index in the file
+    void *page;
+    bool is_dirty;
+} CachedPage;
+
+/**
+    @brief at most so many pages are cached, unless more are mapped or
+    dirty. The least recently used clean ones that nobody maps are dropped
+    first, also by the reclaimer when memory runs low.
+ */
+#define PAGECACHE_MAX_PAGES 4096
+
+/**
+    @brief the writeback thread writes all dirty pages back every so many
+    milliseconds, or earlier when kicked.
+ */
+#define WRITEBACK_INTERVAL_MS 5000
+
+void init_pagecache();
+
+/**
+    @brief get page `index` of `inode` if it is cached, without any I/O.
+
+    @return the page with one more reference, or NULL.
+ */
+WARN_RESULT void *pagecache_lookup(Inode *inode, usize index);
+
+/**
+    @brief get page `index` of `inode`, reading it from disk if not cached.
+
+    Bytes beyond the end of file are zero.
+
+    @return the page with one more reference.
+
+    @note caller must NOT hold the lock of `inode`.
+ */
+WARN_RESULT void *pagecache_get(Inode *inode, usize index);
+
+/**
+    @brief copy `count` bytes at `src` into the cached pages at `offset`.
+
+    Called by the inode layer on every write, so that the cache never holds
+    stale data.
+
+    @note caller must hold the lock of `inode`.
+ */
+void pagecache_update(Inode *inode, const u8 *src, usize offset, usize count);
+
+/**
+    @brief map `page`, got as page `index` of `inode`, at `*pte` with `flags`
+    if it is still cached. A page dropped meanwhile must not be mapped, as
+    nobody would write it back or unmap it. Without `PTE_RO` in `flags` the
+    page is marked dirty too.
+
+    @return false if the page was dropped. The caller still holds its
+    reference then, and gets the page again.
+ */
+WARN_RESULT bool pagecache_map(Inode *inode, usize index, void *page, PTEntry *pte, u64 flags);
+
+/**
+    @brief mark page `index` of `inode` dirty and make `*pte`, which maps it
+    in a shared mapping, writable.
+
+    @return false, leaving `*pte` read-only, if `*pte` does not map the
+    cached page, e.g. after the page was dropped. The caller unmaps it and
+    faults the page in again.
+
+    @note the caller flushes the TLB entry of `*pte`.
+ */
+WARN_RESULT bool pagecache_set_dirty(Inode *inode, usize index, PTEntry *pte);
+
+/**
+    @brief write the cached page `index` back to the file through the journal,
+    if it is dirty.
+
+    Bytes beyond the end of file are not written.
+
+    @note caller must NOT hold the lock of `inode`.
+ */
+void pagecache_writeback(Inode *inode, usize index);
+
+/**
+    @brief write back the dirty pages among [first, last] of `inode`.
+
+    @note caller must NOT hold the lock of `inode`.
+ */
+void pagecache_sync(Inode *inode, usize first, usize last);
+
+/**
+    @brief wake the writeback thread up to write all dirty pages back now.
+ */
+void pagecache_kick_writeback();
+
+/**
+    @brief link a `MAP_SHARED` section into / out of the mappings of its file.
+ */
+void pagecache_add_mapping(struct section *sec);
+void pagecache_remove_mapping(struct section *sec);
+
+/**
+    @brief drop the cached pages overlapping [offset, offset + count).
+
+    Pages already mapped by someone stay alive until unmapped. Dirty pages
+    are dropped without writeback.
+
+    @note caller must hold the lock of `inode`.
+ */
+void pagecache_invalidate(Inode *inode, usize offset, usize count);
+
+/**
+    @brief read pages [index, index + count) of `inode` into the cache in
+    the background. It is a hint: the request may be dropped.
+ */
+void pagecache_readahead(Inode *inode, usize index, usize count);
+
+/**
+    @brief read blocks [index, index + count) of `inode` into the block
+    cache in the background, see `inodes.readahead`. A hint as well.
+ */
+void pagecache_readahead_blocks(Inode *inode, usize index, usize count);
@@ -1,16 +1,22 @@
+#include <sys/mman.h>
+
 #include <aarch64/mmu.h>
+#include <aarch64/trap.h>
 #include <common/defines.h>
 #include <common/list.h>
 #include <common/sem.h>
 #include <common/string.h>
 #include <fs/block_device.h>
 #include <fs/cache.h>
+#include <kernel/ksm.h>
 #include <kernel/mem.h>
+#include <kernel/pagecache.h>
 #include <kernel/paging.h>
 #include <kernel/printk.h>
 #include <kernel/proc.h>
 #include <kernel/pt.h>
 #include <kernel/sched.h>
+#include <kernel/swap.h>
 
 #ifdef DEBUG
 #define printk(fmt, ...) printk(fmt, ##__VA_ARGS__)
@@ -28,17 +34,110 @@ __attribute__((unused)) void init_sections(ListNode *section_head) {
     sec->fp = NULL;
 }
 
+#define PTE(p) (PTEntry *)P2K(PTE_ADDRESS(p))
+
 #define for_list(node) for (ListNode *p = node.next; p != &node; p = p->next)
 
+/* Drop the page or swap slot `*pte` refers to, and clear it. */
+void clear_user_pte(PTEntry *pte) {
+    if (*pte & PTE_VALID)
+        kfree_page((void *)P2K(PTE_ADDRESS(*pte)));
+    else if (is_swap_pte(*pte))
+        swap_free(*pte);
+    *pte = 0;
+}
+
+#define FREE_BATCH 32
+
+typedef struct {
+    struct pgdir *pd;
+    u64 begin, end;
+    void *pages[FREE_BATCH];  // to be freed
+    usize n;
+} Unmap;
+
+static void unmap_put(Unmap *u, void *page) {
+    u->pages[u->n++] = page;
+    if (u->n == FREE_BATCH) {
+        kfree_pages(u->pages, u->n);
+        u->n = 0;
+    }
+}
+
+static bool table_empty(PTEntriesPtr table) {
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        if (table[i])
+            return false;
+    return true;
+}
+
+/*
+ * Unmap the part of [u->begin, u->end) in `table` at `level` (0 to 3), which
+ * maps from `base`. Tables emptied on the way are freed. A block or contiguous
+ * group only partly in the range is split first by `split_huge`.
+ */
+static void unmap_table(Unmap *u, PTEntriesPtr table, int level, u64 base) {
+    int shift = 39 - 9 * level;
+    u64 size = 1ull << shift;
+    usize first = u->begin > base ? (u->begin - base) >> shift : 0;
+    usize last = MIN((u->end - 1 - base) >> shift, (u64)N_PTE_PER_TABLE - 1);
+    for (usize i = first; i <= last; i++) {
+        u64 va = base + i * size;
+        if (table[i] == 0)
+            continue;
+        if (level == 3) {
+            u64 group = va & ~(CONT_PTES * PAGE_SIZE - 1);
+            if ((table[i] & PTE_CONT) && (group < u->begin || group + CONT_PTES * PAGE_SIZE > u->end))
+                split_huge(u->pd, va);
+            if (table[i] & PTE_VALID)
+                unmap_put(u, (void *)P2K(PTE_ADDRESS(table[i])));
+            else if (is_swap_pte(table[i]))
+                swap_free(table[i]);
+            table[i] = 0;
+            continue;
+        }
+        bool whole = va >= u->begin && va + size <= u->end;
+        if (PTE_IS_BLOCK(table[i])) {
+            if (whole) {
+                for (int j = 0; j < N_PTE_PER_TABLE; j++)
+                    unmap_put(u, (void *)P2K(PTE_ADDRESS(table[i]) + (u64)j * PAGE_SIZE));
+                table[i] = 0;
+                continue;
+            }
+            split_huge(u->pd, MAX(va, u->begin));
+        }
+        PTEntriesPtr next = PTE(table[i]);
+        unmap_table(u, next, level + 1, va);
+        if (whole || table_empty(next)) {
+            table[i] = 0;
+            kfree_page(next);
+        }
+    }
+}
+
+/*
+ * Unmap [begin, end) of `pd`, dropping its pages and swap slots, in one walk
+ * of the page table. The caller flushes the TLB.
+ */
+void clear_user_range(struct pgdir *pd, u64 begin, u64 end) {
+    if (pd->pt == NULL || begin >= end)
+        return;
+    Unmap u = {.pd = pd, .begin = begin, .end = end, .n = 0};
+    unmap_table(&u, pd->pt, 0, 0);
+    kfree_pages(u.pages, u.n);
+}
+
 void free_sections(struct pgdir *pd) {
     printk("free_sections\n");
+    swap_remove_pgdir(pd);
+    ksm_remove_pgdir(pd);
     for_list(pd->section_head) {
         struct section *sec = container_of(p, struct section, stnode);
-        for (u64 i = PAGE_BASE(sec->begin); i < sec->end; i += PAGE_SIZE) {
-            auto pte = get_pte(pd, i, false);
-            if (pte && (*pte & PTE_VALID))
-                kfree_page((void *)P2K(PTE_ADDRESS(*pte)));
+        if (sec->mmap_flags & MAP_SHARED) {
+            pagecache_remove_mapping(sec);
+            filemap_writeback(sec, sec->begin, sec->end);
         }
+        clear_user_range(pd, PAGE_BASE(sec->begin), sec->end);
         if (sec->fp) {
             file_close(sec->fp);
         }
@@ -49,14 +148,16 @@ void free_sections(struct pgdir *pd) {
 }
 
 #define REVERSED_PAGES 1024  // Reversed pages
+#define RECLAIM_RETRIES 8
 
+/*
+ * The last REVERSED_PAGES are kept for the kernel: user pages wait for the
+ * reclaimer to swap something out first. If it cannot, dig into the reserve
+ * rather than fail.
+ */
 void *alloc_page_for_user() {
-    // no swap
-
-    // while (left_page_cnt() <= REVERSED_PAGES) {
-    //     // TODO
-    //     return NULL;
-    // }
+    for (int i = 0; i < RECLAIM_RETRIES && left_page_cnt() <= REVERSED_PAGES; i++)
+        wait_for_reclaim();
     return kalloc_page();
 }
 
@@ -80,15 +181,11 @@ __attribute__((unused)) u64 sbrk(i64 size) {
 
     sec->end += size;  // lazy allocation
     if (size < 0) {
-        for (i64 i = 0; i < -size; i += PAGE_SIZE) {
-            PTEntry *pte = get_pte(pd, sec->end + i, false);
-            if (pte && *pte) {
-                kfree_page((void *)(P2K(PTE_ADDRESS(*pte))));
-                *pte = 0;
-            }
-        }
+        acquire_spinlock(&pd->lock);  // against the reclaimer
+        clear_user_range(pd, sec->end, old_end);
+        release_spinlock(&pd->lock);
+        flush_tlb_range(pd, sec->end, old_end);
     }
-    arch_tlbi_vmalle1is();
     return old_end;
 }
 
@@ -98,6 +195,222 @@ __attribute__((unused)) u64 sbrk(i64 size) {
 #define USER_STACK_TOP (USERTOP - USTACK_SIZE)
 #define MIN_STACK_SIZE (4 * PAGE_SIZE)
 
+#define FAULT_AROUND_PAGES 16
+#define RA_MIN_PAGES 4
+#define RA_MAX_PAGES 32
+
+// the page index in the file of user address `va` in mmap'd section `sec`.
+static INLINE usize file_page_index(struct section *sec, u64 va) {
+    return (sec->offset + PAGE_BASE(va) - sec->begin) / PAGE_SIZE;
+}
+
+/*
+ * Keep a readahead window in front of sequential faults. It starts right
+ * after the faulting page, and once the faults have gone through half of it
+ * the next (twice as large) window is read. A random fault drops the window.
+ * MADV_SEQUENTIAL starts with the largest window, MADV_RANDOM disables it.
+ */
+static void filemap_readahead(struct section *sec, Inode *ip, usize index) {
+    usize prev = sec->ra_prev;
+    sec->ra_prev = index;
+    if (sec->advice == MADV_RANDOM)
+        return;
+
+    bool seq = sec->advice == MADV_SEQUENTIAL ||
+               (index > prev && index <= prev + FAULT_AROUND_PAGES) ||
+               (index >= sec->ra_start && index <= sec->ra_start + sec->ra_size);
+    if (!seq) {
+        sec->ra_size = 0;
+        return;
+    }
+
+    usize size = sec->advice == MADV_SEQUENTIAL ? RA_MAX_PAGES : RA_MIN_PAGES;
+    if (sec->ra_size)
+        size = MIN(sec->ra_size * 2, (usize)RA_MAX_PAGES);
+    if (sec->ra_size == 0 || index >= sec->ra_start + sec->ra_size)
+        sec->ra_start = index + 1;
+    else if (index >= sec->ra_start + sec->ra_size / 2)
+        sec->ra_start += sec->ra_size;
+    else
+        return;
+    sec->ra_size = size;
+
+    usize last = file_page_index(sec, sec->end - 1);
+    if (sec->ra_start <= last)
+        pagecache_readahead(ip, sec->ra_start, MIN(size, last + 1 - sec->ra_start));
+}
+
+/*
+ * Page cache pages are always mapped read-only first. On the first write a
+ * private mapping copies the page, and a shared mapping marks it dirty.
+ */
+#define FILEMAP_PTE_FLAGS (PTE_USER_DATA | PTE_RO)
+
+/*
+ * Map the pages around `addr` that are already in the page cache, so that
+ * a sequential scan does not fault on every page. Only in page tables that
+ * exist: none is allocated for a page that may never be touched.
+ */
+static void filemap_map_around(struct pgdir *pd, struct section *sec, Inode *ip, u64 addr) {
+    u64 span = FAULT_AROUND_PAGES * PAGE_SIZE;
+    u64 begin = MAX(PAGE_BASE(sec->begin), round_down(addr, span));
+    u64 end = MIN(sec->end, round_down(addr, span) + span);
+    for (u64 va = begin; va < end; va += PAGE_SIZE) {
+        PTEntry *pte = get_pte(pd, va, false);
+        if (!pte || *pte)
+            continue;
+        usize index = file_page_index(sec, va);
+        void *page = pagecache_lookup(ip, index);
+        if (page && !pagecache_map(ip, index, page, pte, FILEMAP_PTE_FLAGS))
+            kfree_page(page);
+    }
+}
+
+// fault in a page of an mmap'd file.
+static void filemap_fault(struct pgdir *pd, struct section *sec, u64 addr, bool write) {
+    Inode *ip = sec->fp->ip;
+    usize index = file_page_index(sec, addr);
+    filemap_readahead(sec, ip, index);
+
+    PTEntry *pte = get_pte(pd, addr, true);
+    if (write && !(sec->mmap_flags & MAP_SHARED)) {
+        void *page = pagecache_get(ip, index);
+        void *copy = alloc_page_for_user();
+        memcpy(copy, page, PAGE_SIZE);
+        kfree_page(page);
+        *pte = K2P(copy) | PTE_USER_DATA;
+    } else {
+        u64 flags = write ? FILEMAP_PTE_FLAGS & ~PTE_RO : FILEMAP_PTE_FLAGS;
+        while (true) {
+            void *page = pagecache_get(ip, index);
+            if (pagecache_map(ip, index, page, pte, flags))
+                break;
+            kfree_page(page);  // invalidated meanwhile
+        }
+    }
+
+    if (sec->advice != MADV_RANDOM)
+        filemap_map_around(pd, sec, ip, addr);
+}
+
+/* Write the dirty pages of shared mapping `sec` in [begin, end) back to the file. */
+void filemap_writeback(struct section *sec, u64 begin, u64 end) {
+    if (begin < end)
+        pagecache_sync(sec->fp->ip, file_page_index(sec, begin), file_page_index(sec, end - 1));
+}
+
+/*
+ * Huge pages. A 2 MiB aligned part of a private anonymous section (not
+ * mmap'd, not read-only) is mapped by one block on its first write if memory
+ * is plentiful; a table of such pages that fills up is collapsed into one.
+ * Blocks are never swapped out, `split_huge` splits them when a page changes.
+ */
+#define HUGE_MIN_FREE_PAGES (HIGH_WATERMARK_PAGES + N_PTE_PER_TABLE)
+
+static bool huge_allowed(struct section *sec, u64 addr) {
+    u64 base = HUGE_BASE(addr);
+    return !sec->mmap_flags && !(sec->flags & ST_RO) && base >= sec->begin &&
+           base + HUGE_PAGE_SIZE <= sec->end && left_page_cnt() >= HUGE_MIN_FREE_PAGES;
+}
+
+/*
+ * Give the read-only private page at `*pte` a copy of its own. ksmd changes
+ * such PTEs under the lock of `pd`: if `*pte` changed meanwhile, the access
+ * is simply retried.
+ */
+static void cow_page(struct pgdir *pd, PTEntry *pte, u64 addr) {
+    split_huge(pd, addr);
+    PTEntry old = *pte;
+    void *old_page = (void *)P2K(PTE_ADDRESS(old));
+    void *new_page = alloc_page_for_user();
+    acquire_spinlock(&pd->lock);
+    if (*pte != old) {
+        release_spinlock(&pd->lock);
+        kfree_page(new_page);
+        return;
+    }
+    if (old_page == get_zero_page())
+        memset(new_page, 0, PAGE_SIZE);
+    else
+        memcpy(new_page, old_page, PAGE_SIZE);
+    *pte = K2P(new_page) | PTE_USER_DATA;
+    release_spinlock(&pd->lock);
+    flush_tlb_page(pd, addr);
+    ksm_cow_break(old_page);
+    kfree_page(old_page);
+}
+
+// map a zeroed block at `addr` if nothing is mapped around it.
+static bool huge_fault(struct pgdir *pd, struct section *sec, u64 addr) {
+    if (!huge_allowed(sec, addr))
+        return false;
+    PTEntry *pmd = get_huge_pte(pd, addr, true);
+    if (*pmd)
+        return false;
+    void *huge = kalloc_huge();
+    if (huge == NULL)
+        return false;
+    memset(huge, 0, HUGE_PAGE_SIZE);
+    *pmd = K2P(huge) | PTE_USER_BLOCK;
+    return true;
+}
+
+static bool page_collapsible(PTEntry e) {
+    return (e & PTE_VALID) && !(e & PTE_RO) && rc(P2K(PTE_ADDRESS(e))) == 1;
+}
+
+// is the table full of private writable pages?
+static bool table_collapsible(PTEntriesPtr table) {
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        if (!page_collapsible(table[i]))
+            return false;
+    return true;
+}
+
+/*
+ * Is it worth scanning the table around `addr`? Its ends and the neighbours
+ * of `addr` are checked first, so that the table is not scanned on every
+ * fault while it fills up, in either direction or at random.
+ */
+static bool may_collapse(PTEntriesPtr table, u64 addr) {
+    usize i = VA_PART3(addr);
+    return page_collapsible(table[0]) && page_collapsible(table[N_PTE_PER_TABLE - 1]) &&
+           (i == 0 || page_collapsible(table[i - 1])) &&
+           (i == N_PTE_PER_TABLE - 1 || page_collapsible(table[i + 1]));
+}
+
+// replace the table around `addr` by a block, if it is full.
+static void huge_collapse(struct pgdir *pd, struct section *sec, u64 addr) {
+    if (!huge_allowed(sec, addr))
+        return;
+    PTEntry *pmd = get_huge_pte(pd, addr, false);
+    if (pmd == NULL || (*pmd & PTE_TABLE) != PTE_TABLE || !may_collapse(PTE(*pmd), addr) ||
+        !table_collapsible(PTE(*pmd)))
+        return;
+    PTEntriesPtr table = PTE(*pmd);
+    char *huge = kalloc_huge();
+    if (huge == NULL)
+        return;
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        memcpy(huge + i * PAGE_SIZE, (void *)P2K(PTE_ADDRESS(table[i])), PAGE_SIZE);
+
+    // only we write the pages, but the reclaimer may have taken one meanwhile.
+    acquire_spinlock(&pd->lock);
+    bool ok = table_collapsible(table);
+    if (ok) {
+        *pmd = 0;  // break before make
+        flush_tlb_range(pd, HUGE_BASE(addr), HUGE_BASE(addr) + HUGE_PAGE_SIZE);
+        *pmd = K2P(huge) | PTE_USER_BLOCK;
+    }
+    release_spinlock(&pd->lock);
+
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        kfree_page(ok ? (void *)P2K(PTE_ADDRESS(table[i])) : huge + i * PAGE_SIZE);
+    if (ok)
+        kfree_page(table);
+    printk("huge_collapse: %llx %s\n", HUGE_BASE(addr), ok ? "done" : "raced");
+}
+
 int pgfault_handler(u64 iss) {
     Proc *p = thisproc();
     struct pgdir *pd = &p->pgdir;
@@ -147,57 +460,130 @@ int pgfault_handler(u64 iss) {
 
     printk("  successfuly handled on sec: %llx %llx %x %x\n", sec->begin, sec->end, sec->flags, sec->mmap_flags);
 
+    bool write = iss & ESR_ISS_WNR;
+    if (write && huge_fault(pd, sec, addr)) {
+        printk(" - Huge page\n");
+        return 0;
+    }
+
+    PTEntry *pte = get_pte(pd, addr, true);
+    if (pte == NULL)  // mapped by a block meanwhile
+        return 0;
+    if ((*pte & PTE_VALID) && !(*pte & AF_USED)) {  // cleared by the reclaimer
+        acquire_spinlock(&pd->lock);
+        if (*pte & PTE_VALID)
+            *pte |= AF_USED;
+        release_spinlock(&pd->lock);
+        return 0;
+    }
+    if (is_swap_pte(*pte)) {
+        printk(" - Swap in\n");
+        swap_in(pte);
+        return 0;
+    }
+
     if (sec->mmap_flags) {
-        void *new_page = kalloc_page();
-        vmmap(pd, addr, new_page, PTE_USER_DATA);
-        arch_tlbi_vmalle1is();
         struct file *f = sec->fp;
         if (!f->readable || f->type != FD_INODE) {
             printk("Invalid mmap file access\n");
             goto bad;
         }
-        u64 offset = sec->offset + (addr - sec->begin);
-        inodes.lock(f->ip);
-        int n = inodes.read(f->ip, new_page, offset, PAGE_SIZE);
-        inodes.unlock(f->ip);
-        // 如果读取的内容不足一页，将剩余部分清零
-        if (n < PAGE_SIZE) {
-            memset(new_page + n, 0, PAGE_SIZE - n);
+        if (!(*pte & PTE_VALID)) {
+            filemap_fault(pd, sec, addr, iss & ESR_ISS_WNR);
+        } else if ((*pte & PTE_RO) && (sec->mmap_flags & MAP_SHARED)) {
+            // first write to a clean page
+            if (!pagecache_set_dirty(f->ip, file_page_index(sec, addr), pte)) {
+                // no longer cached: writes to it would be lost.
+                acquire_spinlock(&pd->lock);
+                void *page = (void *)P2K(PTE_ADDRESS(*pte));
+                *pte = 0;
+                release_spinlock(&pd->lock);
+                flush_tlb_page(pd, addr);
+                kfree_page(page);
+                filemap_fault(pd, sec, addr, true);
+                return 0;
+            }
+            flush_tlb_page(pd, addr);
+        } else if (*pte & PTE_RO) {  // private mapping writes to a page cache page
+            cow_page(pd, pte, addr);
         }
-        return iss;
+        return 0;
     }
 
-    PTEntry *pte = get_pte(pd, addr, true);
-    if (*pte == 0) {  // Lazy allocation
+    if (*pte == 0 && !write) {  // 读：先映射共享的零页，第一次写时再分配
+        printk(" - Zero page\n");
+        vmmap(pd, addr, get_zero_page(), PTE_USER_DATA | PTE_RO);
+    } else if (*pte == 0) {  // Lazy allocation
         printk(" - Lazy allocation\n");
-        vmmap(pd, addr, alloc_page_for_user(), PTE_USER_DATA);
+        *pte = K2P(alloc_page_for_user()) | PTE_USER_DATA;
     } else if (*pte & PTE_RO) {  // Copy on Write
         printk(" - Copy on Write\n");
-        void *new_page = alloc_page_for_user();
-        memcpy(new_page, (void *)P2K(PTE_ADDRESS(*pte)), PAGE_SIZE);
-        vmmap(pd, addr, new_page, PTE_USER_DATA);
-    } else if (!(*pte & PTE_VALID) && (sec->flags & ST_SWAP)) {
-        printk("Page fault on swapped out page\n");
-        PANIC();
+        cow_page(pd, pte, addr);
     }
+    huge_collapse(pd, sec, addr);
 
-    // attach_pgdir(pd);
-    arch_tlbi_vmalle1is();
-    return iss;
+    return 0;
 
 bad:
-    int k = kill(p->pid);
-    ASSERT(k == 0);
-    return iss;
+    return -1;
 }
 
-/* Sharing types (must choose one and only one of these).  */
-#define MAP_SHARED 0x01          /* Share changes.  */
-#define MAP_PRIVATE 0x02         /* Changes are private.  */
-#define MAP_SHARED_VALIDATE 0x03 /* Share changes and validate \
-                                    extension flags.  */
-#define MAP_TYPE 0x0f            /* Mask for type of mapping.  */
+// copy the page at `va` of `from_pd` to `to_pd`. caller must hold `from_pd->lock`.
+static void copy_page(struct pgdir *from_pd, struct pgdir *to_pd, struct section *from_sec, u64 va) {
+    PTEntry *pte_from = get_pte(from_pd, va, false);
+    if (pte_from && is_swap_pte(*pte_from)) {  // 换出的页面：共用 swap slot
+        swap_dup(*pte_from);
+        *get_pte(to_pd, va, true) = *pte_from;
+        return;
+    }
+    if (!pte_from || !(*pte_from & PTE_VALID))
+        return;
+    if (P2K(PTE_ADDRESS(*pte_from)) == (u64)get_zero_page()) {  // 零页：继续共用
+        vmmap(to_pd, va, get_zero_page(), PTE_FLAGS(*pte_from));
+        return;
+    }
+    // 如果是 MAP_SHARED，可以直接共用物理页 + 引用计数
+    if (from_sec->mmap_flags & MAP_SHARED) {
+        PTEntry *pte_to = get_pte(to_pd, va, true);
+        // 直接共享同一个物理页。只读映射：子进程第一次写时再标记为脏页
+        *pte_to = *pte_from | PTE_RO;
+        rc(P2K(PTE_ADDRESS(*pte_from)))++;
+    } else {
+        // MAP_PRIVATE 或其它情况：分配新页并复制
+        void *new_page = kalloc_page();
+        memcpy(new_page, (void *)P2K(PTE_ADDRESS(*pte_from)), PAGE_SIZE);
+        PTEntry *pte_to = get_pte(to_pd, va, true);
+        *pte_to = K2P(new_page) | (PTE_FLAGS(*pte_from) & ~(PTE_RO | PTE_CONT));
+    }
+}
+
+/*
+ * Copy the block `block` at `va` of the parent, whose pages the caller holds a
+ * reference to, to `to_pd`: as a block, or page by page if there is no huge
+ * page free. The references are dropped.
+ */
+static void copy_block(struct pgdir *to_pd, u64 va, PTEntry block) {
+    char *from = (char *)P2K(PTE_ADDRESS(block));
+    void *huge = kalloc_huge();
+    if (huge) {
+        memcpy(huge, from, HUGE_PAGE_SIZE);
+        *get_huge_pte(to_pd, va, true) = K2P(huge) | PTE_FLAGS(block);
+    }
+    for (int i = 0; i < N_PTE_PER_TABLE; i++) {
+        if (!huge) {
+            void *new_page = kalloc_page();
+            memcpy(new_page, from + i * PAGE_SIZE, PAGE_SIZE);
+            *get_pte(to_pd, va + i * PAGE_SIZE, true) = K2P(new_page) | PTE_FLAGS(block) | PTE_PAGE;
+        }
+        kfree_page(from + i * PAGE_SIZE);
+    }
+}
 
+/*
+ * Pages are copied under the lock of the parent, against the reclaimer and
+ * ksmd. Blocks are not, so that the lock is not held for a whole 2 MiB copy:
+ * the entry is read once under the lock, and its pages are held meanwhile.
+ */
 void copy_sections(ListNode *from_head, ListNode *to_head) {
     for_list((*from_head)) {
         struct section *from_sec = container_of(p, struct section, stnode);
@@ -215,20 +601,26 @@ void copy_sections(ListNode *from_head, ListNode *to_head) {
         struct pgdir *from_pd = container_of(from_head, struct pgdir, section_head);
         struct pgdir *to_pd = container_of(to_head, struct pgdir, section_head);
 
+        if (from_sec->mmap_flags & MAP_SHARED) {
+            to_sec->pgdir = to_pd;
+            pagecache_add_mapping(to_sec);
+        }
+
         for (u64 va = PAGE_BASE(from_sec->begin); va < from_sec->end; va += PAGE_SIZE) {
-            PTEntry *pte_from = get_pte(from_pd, va, false);
-            if (!pte_from || !(*pte_from & PTE_VALID))
-                continue;
-            // 如果是 MAP_SHARED，可以直接共用物理页 + 引用计数
-            if (from_sec->mmap_flags & MAP_SHARED) {
-                PTEntry *pte_to = get_pte(to_pd, va, true);
-                *pte_to = *pte_from;  // 直接共享同一个物理页
+            acquire_spinlock(&from_pd->lock);
+            PTEntry *pmd = get_huge_pte(from_pd, va, false);
+            PTEntry block = pmd ? *pmd : 0;
+            if (PTE_IS_BLOCK(block)) {  // 大页：持有其页面，放锁后再复制
+                for (int i = 0; i < N_PTE_PER_TABLE; i++)
+                    rc(P2K(PTE_ADDRESS(block) + (u64)i * PAGE_SIZE))++;
             } else {
-                // MAP_PRIVATE 或其它情况：分配新页并复制
-                void *new_page = kalloc_page();
-                memcpy(new_page, (void *)P2K(PTE_ADDRESS(*pte_from)), PAGE_SIZE);
-                PTEntry *pte_to = get_pte(to_pd, va, true);
-                *pte_to = K2P(new_page) | (PTE_FLAGS(*pte_from) & ~PTE_RO);
+                copy_page(from_pd, to_pd, from_sec, va);
+            }
+            release_spinlock(&from_pd->lock);
+            if (PTE_IS_BLOCK(block)) {
+                va = HUGE_BASE(va);
+                copy_block(to_pd, va, block);
+                va += HUGE_PAGE_SIZE - PAGE_SIZE;
             }
         }
     }
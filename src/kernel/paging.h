@@ -23,14 +23,32 @@ struct section {
     struct file *fp;
     u64 offset; // Offset in file
     u64 length; // Length of mapped content in file
+
+    /* Readahead state of mmap'd files, see `filemap_fault`. */
+
+    int advice;      // MADV_NORMAL, MADV_SEQUENTIAL or MADV_RANDOM
+    usize ra_start;  // first page index of the current readahead window
+    usize ra_size;   // pages in the window, 0 if there is none
+    usize ra_prev;   // page index of the last fault
+
+    /* MAP_SHARED sections are linked into `Inode.mappings`, so that the page
+       cache can write-protect them again after writing a page back. */
+
+    ListNode mapnode;
+    struct pgdir *pgdir;  // the address space the section belongs to
 };
 
 inline bool in_section(struct section *sec, u64 addr) {
     return addr >= sec->begin && addr < sec->end;
 } 
 
+// return 0 if the fault is resolved, -1 if the access is invalid.
 int pgfault_handler(u64 iss);
 void init_sections(ListNode *section_head);
 void free_sections(struct pgdir *pd);
 void copy_sections(ListNode *from_head, ListNode *to_head);
+void filemap_writeback(struct section *sec, u64 begin, u64 end);
+WARN_RESULT void *alloc_page_for_user();
+void clear_user_pte(PTEntry *pte);
+void clear_user_range(struct pgdir *pd, u64 begin, u64 end);
 u64 sbrk(i64 size);
@@ -1,10 +1,12 @@
 #include <common/list.h>
 #include <common/string.h>
+#include <kernel/ksm.h>
 #include <kernel/mem.h>
 #include <kernel/paging.h>
 #include <kernel/printk.h>
 #include <kernel/proc.h>
 #include <kernel/sched.h>
+#include <kernel/swap.h>
 
 Proc root_proc;
 
@@ -56,6 +58,27 @@ void init_proc(Proc *p) {
     p->kcontext = (KernelContext *)((u64)p->ucontext - sizeof(KernelContext));
     init_oftable(&p->oftable);
     p->cwd = inodes.root;
+    p->iobuf = NULL;
+}
+
+// iobufs of exited processes, chained through their first word. they are
+// reused rather than freed, since `kalloc_large` never reuses its pages.
+static void *spare_iobuf;
+
+// see `fs/file.h`.
+char *file_iobuf() {
+    Proc *p = thisproc();
+    if (!p->iobuf) {
+        acquire_spinlock(&plock);
+        p->iobuf = spare_iobuf;
+        if (p->iobuf)
+            spare_iobuf = *(void **)p->iobuf;
+        release_spinlock(&plock);
+    }
+    if (!p->iobuf)
+        p->iobuf = kalloc_large(FILE_IOBUF_SIZE);
+    ASSERT(p->iobuf);
+    return p->iobuf;
 }
 
 Proc *create_proc() {
@@ -170,10 +193,14 @@ NO_RETURN void exit(int code) {
     inodes.put(&ctx, this->cwd);
     bcache.end_op(&ctx);
     this->cwd = NULL;
-
     free_sections(&this->pgdir);  // must free sections before free_pgdir
 
     acquire_spinlock(&plock);
+    if (this->iobuf) {
+        *(void **)this->iobuf = spare_iobuf;
+        spare_iobuf = this->iobuf;
+        this->iobuf = NULL;
+    }
     post_sem(&this->parent->childexit);
 
     int zcnt = 0;
@@ -279,23 +306,9 @@ int fork() {
     }
     Proc *cp = thisproc();
 
-    acquire_spinlock(&cp->pgdir.lock);
-    // ptcopy(&np->pgdir, cp->pgdir.pt); // (&cp->pgdir)->pt
-
-    PTEntriesPtr old_pte;
-    for_list(cp->pgdir.section_head) {
-        struct section *st = container_of(p, struct section, stnode);
-        // Copy on Write
-        for (u64 va = PAGE_BASE(st->begin); va < st->end; va += PAGE_SIZE) {
-            old_pte = get_pte(&(cp->pgdir), va, false);
-            if ((old_pte == NULL) || !(*old_pte & PTE_VALID)) {
-                continue;
-            }
-            vmmap(&(np->pgdir), va, (void *)P2K(PTE_ADDRESS(*old_pte)), PTE_FLAGS(*old_pte) | PTE_RO);
-        }
-    }
     copy_sections(&cp->pgdir.section_head, &np->pgdir.section_head);
-    release_spinlock(&cp->pgdir.lock);
+    swap_add_pgdir(&np->pgdir);
+    ksm_add_pgdir(&np->pgdir);
 
     set_parent_to_this(np);
     memcpy(np->ucontext, cp->ucontext, sizeof(*np->ucontext));
@@ -47,6 +47,7 @@ typedef struct Proc {
     KernelContext *kcontext;
     struct oftable oftable;
     Inode *cwd;
+    void *iobuf;  // see `file_iobuf`, allocated on first use
 } Proc;
 
 void init_kproc();
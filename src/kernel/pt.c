@@ -1,7 +1,10 @@
 #include <aarch64/intrinsic.h>
+#include <common/bitmap.h>
 #include <common/string.h>
+#include <kernel/cpu.h>
 #include <kernel/mem.h>
 #include <kernel/pt.h>
+#include <kernel/syscall.h>
 
 #define PTE(p) (PTEntry *)P2K(PTE_ADDRESS(p))
 
@@ -17,33 +20,87 @@
     p;                                   \
 })
 
-PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc) {
-    // Return a pointer to the PTE (Page Table Entry) for virtual address 'va'
-    // If the entry not exists (NEEDN'T BE VALID), allocate it if alloc=true, or return NULL if false.
-    // THIS ROUTINUE GETS THE PTE, NOT THE PAGE DESCRIBED BY PTE.
-
+PTEntriesPtr get_huge_pte(struct pgdir *pgdir, u64 va, bool alloc) {
     if (!pgdir->pt) {
         if (!alloc)
             return NULL;
         pgdir->pt = cpalloc();
     }
     PTEntriesPtr p0 = chk(pgdir->pt + VA_PART0(va)),
-                 p1 = chk(PTE(*p0) + VA_PART1(va)),
-                 p2 = chk(PTE(*p1) + VA_PART2(va));
+                 p1 = chk(PTE(*p0) + VA_PART1(va));
+    return PTE(*p1) + VA_PART2(va);
+}
+
+/*
+ * Changing the size of a valid mapping must break before make: the entries
+ * are cleared and flushed first, or the TLB may hold both sizes at once.
+ */
+
+// replace the block `*pmd` by a table of the same pages.
+static void split_block(struct pgdir *pgdir, PTEntry *pmd, u64 va) {
+    PTEntriesPtr table = kalloc_page();
+    u64 pa = PTE_ADDRESS(*pmd), flags = PTE_FLAGS(*pmd) | PTE_PAGE | PTE_CONT;
+    for (int i = 0; i < N_PTE_PER_TABLE; i++)
+        table[i] = (pa + (u64)i * PAGE_SIZE) | flags;
+    *pmd = 0;
+    flush_tlb_range(pgdir, HUGE_BASE(va), HUGE_BASE(va) + HUGE_PAGE_SIZE);
+    *pmd = K2P(table) | PTE_TABLE;
+}
+
+// clear the contiguous hint of the group `pte` is in.
+static void split_cont(struct pgdir *pgdir, PTEntry *pte, u64 va) {
+    PTEntry *group = (PTEntry *)((u64)pte & ~(CONT_PTES * sizeof(PTEntry) - 1)),
+            saved[CONT_PTES];
+    u64 base = va & ~(CONT_PTES * PAGE_SIZE - 1);
+    for (int i = 0; i < CONT_PTES; i++) {
+        saved[i] = group[i];
+        group[i] = 0;
+    }
+    flush_tlb_range(pgdir, base, base + CONT_PTES * PAGE_SIZE);
+    for (int i = 0; i < CONT_PTES; i++)
+        group[i] = saved[i] & ~PTE_CONT;
+}
+
+PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc) {
+    // Return a pointer to the PTE (Page Table Entry) for virtual address 'va'
+    // If the entry not exists (NEEDN'T BE VALID), allocate it if alloc=true, or return NULL if false.
+    // THIS ROUTINUE GETS THE PTE, NOT THE PAGE DESCRIBED BY PTE.
+    // NULL too if 'va' is in a block. Nothing is split, see `split_huge`.
+
+    PTEntriesPtr p2 = get_huge_pte(pgdir, va, alloc);
+    if (p2 == NULL || PTE_IS_BLOCK(*p2))
+        return NULL;
+    p2 = chk(p2);
     return PTE(*p2) + VA_PART3(va);
 }
+
+void split_huge(struct pgdir *pgdir, u64 va) {
+    PTEntriesPtr p2 = get_huge_pte(pgdir, va, false);
+    if (p2 == NULL || *p2 == 0)
+        return;
+    if (PTE_IS_BLOCK(*p2))
+        split_block(pgdir, p2, va);
+    PTEntriesPtr pte = PTE(*p2) + VA_PART3(va);
+    if (*pte & PTE_CONT)
+        split_cont(pgdir, pte, va);
+}
 #undef chk
 
 void init_pgdir(struct pgdir *pgdir) {
     pgdir->pt = NULL;
+    pgdir->asid = 0;
     init_spinlock(&pgdir->lock);
     init_list_node(&pgdir->section_head);
+    init_list_node(&pgdir->swapnode);
+    pgdir->swap_hand = 0;
+    init_list_node(&pgdir->ksmnode);
+    pgdir->ksm_hand = 0;
 }
 
 static void free_entry(PTEntriesPtr p, unsigned deep) {
     if (deep < 3)
         for (int i = 0; i < N_PTE_PER_TABLE; ++i)
-            if (p[i])
+            if ((p[i] & PTE_TABLE) == PTE_TABLE)
                 free_entry(PTE(p[i]), deep + 1);
     kfree_page(p);
 }
@@ -58,12 +115,118 @@ void free_pgdir(struct pgdir *pgdir) {
     pgdir->pt = NULL;
 }
 
+/*
+ * ASID allocator.
+ *
+ * pgdir->asid holds a generation in the bits above ASID_BITS. An ASID is
+ * only handed out once per generation, so the TLB entries of a dead address
+ * space can never be hit by another one and need no flushing. When the ASIDs
+ * run out the generation rolls over: all TLBs are flushed once, and the ASIDs
+ * running on other CPUs right now are kept (reserved) for their owners.
+ * ASID 0 is used with invalid_pt.
+ */
+#define NUM_ASIDS (1 << ASID_BITS)
+#define ASID_MASK (NUM_ASIDS - 1)
+
+static SpinLock asid_lock;
+static u64 asid_generation = NUM_ASIDS;
+static u64 asid_next = 1;
+static Bitmap(asid_map, NUM_ASIDS);
+static u64 active_asid[NCPU], reserved_asid[NCPU];
+
+define_early_init(asid) {
+    init_spinlock(&asid_lock);
+    bitmap_set(asid_map, 0);
+}
+
+/*
+ * A CPU switches to a pgdir of the current generation without `asid_lock`,
+ * by a CAS on its `active_asid`. The rollover clears them all, so that a
+ * racing switch fails and takes the lock. A CPU whose `active_asid` is 0
+ * still runs its reserved one.
+ */
+static void asid_rollover() {
+    __atomic_store_n(&asid_generation, asid_generation + NUM_ASIDS, __ATOMIC_RELAXED);
+    memset(asid_map, 0, sizeof(asid_map));
+    bitmap_set(asid_map, 0);
+    for (int i = 0; i < NCPU; i++) {
+        u64 asid = __atomic_exchange_n(&active_asid[i], 0, __ATOMIC_RELAXED);
+        if (asid)
+            reserved_asid[i] = asid;
+        if (reserved_asid[i])
+            bitmap_set(asid_map, reserved_asid[i] & ASID_MASK);
+    }
+    asid_next = 1;
+    arch_tlbi_vmalle1is();
+}
+
+static u64 new_asid(u64 old) {
+    if (old) {
+        for (int i = 0; i < NCPU; i++)
+            if (reserved_asid[i] == old)
+                return asid_generation | (old & ASID_MASK);
+    }
+    while (asid_next < NUM_ASIDS && bitmap_get(asid_map, asid_next))
+        asid_next++;
+    if (asid_next == NUM_ASIDS) {
+        asid_rollover();
+        while (bitmap_get(asid_map, asid_next))
+            asid_next++;
+    }
+    bitmap_set(asid_map, asid_next);
+    return asid_generation | asid_next++;
+}
+
 void attach_pgdir(struct pgdir *pgdir) {
     extern PTEntries invalid_pt;
-    if (pgdir->pt)
-        arch_set_ttbr0(K2P(pgdir->pt));
-    else
+    if (!pgdir->pt) {
+        __atomic_store_n(&active_asid[cpuid()], 0, __ATOMIC_RELAXED);
         arch_set_ttbr0(K2P(&invalid_pt));
+        return;
+    }
+    u64 asid = __atomic_load_n(&pgdir->asid, __ATOMIC_RELAXED);
+    u64 old = __atomic_load_n(&active_asid[cpuid()], __ATOMIC_RELAXED);
+    if (!old || (asid & ~(u64)ASID_MASK) != __atomic_load_n(&asid_generation, __ATOMIC_RELAXED) ||
+        !__atomic_compare_exchange_n(&active_asid[cpuid()], &old, asid, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+        acquire_spinlock(&asid_lock);
+        asid = pgdir->asid;
+        if ((asid & ~(u64)ASID_MASK) != asid_generation) {
+            asid = new_asid(asid);
+            __atomic_store_n(&pgdir->asid, asid, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&active_asid[cpuid()], asid, __ATOMIC_RELAXED);
+        release_spinlock(&asid_lock);
+    }
+    arch_set_ttbr0(K2P(pgdir->pt) | (asid & ASID_MASK) << TTBR_ASID_SHIFT);
+}
+
+/*
+ * Invalidate the TLB entries of user address `va` in `pd`. Needed whenever a
+ * valid PTE is changed or removed; filling an invalid PTE needs nothing.
+ * A stale generation only means the entries were flushed on rollover, and
+ * flushing an ASID that now belongs to someone else is harmless.
+ */
+void flush_tlb_page(struct pgdir *pd, u64 va) {
+    if (pd->asid)
+        arch_tlbi_vale1is(pd->asid & ASID_MASK, va);
+}
+
+#define FLUSH_RANGE_MAX_PAGES 64
+
+/* Like flush_tlb_page, but for [begin, end). Also drops cached table walks. */
+void flush_tlb_range(struct pgdir *pd, u64 begin, u64 end) {
+    if (!pd->asid)
+        return;
+    if ((end - begin) / PAGE_SIZE > FLUSH_RANGE_MAX_PAGES) {
+        arch_tlbi_aside1is(pd->asid & ASID_MASK);
+        return;
+    }
+    arch_dsb_ishst();
+    for (u64 va = PAGE_BASE(begin); va < end; va += PAGE_SIZE)
+        arch_tlbi_vae1is_nosync(pd->asid & ASID_MASK, va);
+    arch_dsb_ish();
+    arch_isb();
 }
 
 /**
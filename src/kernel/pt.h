@@ -8,11 +8,22 @@ struct pgdir {
     PTEntriesPtr pt;
     SpinLock lock;
     ListNode section_head;
+    u64 asid; // generation | ASID, 0 if not assigned yet
+    ListNode swapnode; // in the swappable address spaces, see kernel/swap.c
+    u64 swap_hand;     // where the reclaimer continues scanning
+    ListNode ksmnode;  // in the merging candidates, see kernel/ksm.c
+    u64 ksm_hand;      // where ksmd continues scanning
 };
 
 void init_pgdir(struct pgdir *pgdir);
 WARN_RESULT PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc);
+// the level 2 entry of 'va', a table or block or empty. Never splits.
+WARN_RESULT PTEntriesPtr get_huge_pte(struct pgdir *pgdir, u64 va, bool alloc);
+// split the block or contiguous group around 'va', if any, before one of its pages changes.
+void split_huge(struct pgdir *pgdir, u64 va);
 void free_pgdir(struct pgdir *pgdir);
 void attach_pgdir(struct pgdir *pgdir);
 void vmmap(struct pgdir *pd, u64 va, void *ka, u64 flags);
+void flush_tlb_page(struct pgdir *pd, u64 va);
+void flush_tlb_range(struct pgdir *pd, u64 begin, u64 end);
 int copyout(struct pgdir *pd, void *va, void *p, usize len);
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include <common/buf.h>
+#include <common/sem.h>
+#include <common/spinlock.h>
+#include <common/string.h>
+#include <driver/virtio.h>
+#include <kernel/cpu.h>
+#include <kernel/mem.h>
+#include <kernel/pagecache.h>
+#include <kernel/paging.h>
+#include <kernel/printk.h>
+#include <kernel/proc.h>
+#include <kernel/swap.h>
+
+#ifdef DEBUG
+#define printk(fmt, ...) printk(fmt, ##__VA_ARGS__)
+#else
+#define printk(fmt, ...)
+#endif
+
+#define PTE(p) (PTEntry *)P2K(PTE_ADDRESS(p))
+
+// at most so many pages are swapped out at once.
+#define SWAP_BATCH 16
+// how many user PTEs to look at in one address space per batch.
+#define SCAN_BUDGET 1024
+// give up a round after so many batches in a row found nothing.
+#define MAX_IDLE_BATCHES 64
+
+/*
+ * Locking order: `list_lock`, then `pgdir.lock`, then `swap_lock`.
+ */
+static SpinLock list_lock;  // protects `pgdirs`
+static ListNode pgdirs;     // swappable address spaces, in clock order
+
+static SpinLock swap_lock;               // protects the below
+static u16 slot_count[SWAP_MAX_SLOTS];  // references of each slot, 0 if free
+static usize next_slot;                  // where to look for a free slot next
+
+static u32 swap_start;   // the first sector of the swap partition
+static usize num_slots;  // slots in it, 0 if there is none
+
+// pages being written out. A fault on them takes the page back without I/O.
+static struct {
+    usize slot;
+    void *page;  // NULL if unused
+} writing[SWAP_BATCH];
+
+static Semaphore kswapd_sem, reclaim_sem;
+static bool kswapd_ready, kswapd_pending;
+static struct timer wake_timer[NCPU];
+
+// caller must hold `swap_lock`.
+static isize alloc_slot() {
+    for (usize i = 0; i < num_slots; i++) {
+        usize slot = (next_slot + i) % num_slots;
+        if (slot_count[slot] == 0) {
+            next_slot = slot + 1;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static void put_slot(usize slot) {
+    acquire_spinlock(&swap_lock);
+    ASSERT(slot_count[slot] > 0);
+    slot_count[slot]--;
+    release_spinlock(&swap_lock);
+}
+
+void swap_dup(PTEntry pte) {
+    acquire_spinlock(&swap_lock);
+    slot_count[SWAP_SLOT(pte)]++;
+    release_spinlock(&swap_lock);
+}
+
+void swap_free(PTEntry pte) {
+    put_slot(SWAP_SLOT(pte));
+}
+
+// read / write a page from / to its slot in one request.
+static void slot_rw(usize slot, u8 *page, bool write) {
+    u8 *bufs[SWAP_SECTORS_PER_SLOT];
+    for (usize i = 0; i < SWAP_SECTORS_PER_SLOT; i++)
+        bufs[i] = page + i * BLOCK_SIZE;
+    u32 block_no = swap_start + (u32)(slot * SWAP_SECTORS_PER_SLOT);
+    if (virtio_blk_rwv(block_no, bufs, SWAP_SECTORS_PER_SLOT, write) != 0)
+        PANIC();
+}
+
+// find the swap partition in the partition table of the disk.
+static void find_swap_partition() {
+    Buf b = {.flags = 0, .block_no = 0};
+    virtio_blk_rw(&b);
+    u8 *entry = b.data + 0x1BE + 0x10 * SWAP_PARTITION;
+    if (entry[0x4] != SWAP_PARTITION_TYPE) {
+        printk("(warn) init_swap: no swap partition.\n");
+        return;
+    }
+    u32 num_sectors;  // the entry is not aligned.
+    memcpy(&swap_start, entry + 0x8, sizeof(u32));
+    memcpy(&num_sectors, entry + 0xC, sizeof(u32));
+    num_slots = MIN(num_sectors / SWAP_SECTORS_PER_SLOT, (usize)SWAP_MAX_SLOTS);
+}
+
+void swap_in(PTEntry *pte) {
+    usize slot = SWAP_SLOT(*pte);
+    void *page = NULL, *inflight = NULL;
+    bool last = false;
+    acquire_spinlock(&swap_lock);
+    for (int i = 0; i < SWAP_BATCH; i++) {
+        if (writing[i].page && writing[i].slot == slot) {
+            inflight = writing[i].page;
+            rc(inflight)++;
+            last = slot_count[slot] == 2;
+            break;
+        }
+    }
+    release_spinlock(&swap_lock);
+
+    // the last owner takes a page being written out back, others copy it.
+    if (inflight && last)
+        page = inflight;
+    else {
+        page = alloc_page_for_user();
+        if (inflight) {
+            memcpy(page, inflight, PAGE_SIZE);
+            kfree_page(inflight);
+        } else
+            slot_rw(slot, page, false);
+    }
+    printk("swap_in: slot %lld\n", slot);
+    *pte = K2P(page) | PTE_USER_DATA;
+    put_slot(slot);
+}
+
+void swap_add_pgdir(struct pgdir *pd) {
+    pd->swap_hand = 0;
+    acquire_spinlock(&list_lock);
+    _insert_into_list(pgdirs.prev, &pd->swapnode);
+    release_spinlock(&list_lock);
+}
+
+void swap_remove_pgdir(struct pgdir *pd) {
+    acquire_spinlock(&list_lock);
+    _detach_from_list(&pd->swapnode);
+    release_spinlock(&list_lock);
+    // wait for a scan of `pd` in progress.
+    acquire_spinlock(&pd->lock);
+    release_spinlock(&pd->lock);
+}
+
+typedef struct {
+    struct pgdir *pd;
+    u64 va;        // the next address to look at
+    usize budget;  // PTEs left to look at
+    usize n;       // pages in `writing`
+} Scan;
+
+/*
+ * The clock: a page accessed since the last visit gets a second chance, its
+ * access flag is cleared and the next access will set it again (see
+ * `pgfault_handler`). Otherwise it is unmapped and queued for writing.
+ * Only private pages nobody else maps are taken. The contiguous group of such
+ * a page is split first (blocks are skipped by `scan_table`).
+ */
+static bool scan_pte(Scan *s, PTEntry *pte, u64 va) {
+    PTEntry e = *pte;
+    void *page = (void *)P2K(PTE_ADDRESS(e));
+    if ((e & PTE_VALID) && (e & PTE_USER) && !(e & PTE_RO) && rc(page) == 1) {
+        if (e & PTE_CONT) {
+            split_huge(s->pd, va);
+            e = *pte;
+        }
+        if (e & AF_USED) {
+            *pte = e & ~(u64)AF_USED;
+            flush_tlb_page(s->pd, va);
+        } else {
+            isize slot = alloc_slot();
+            if (slot < 0)
+                return true;
+            *pte = SWAP_PTE(slot);
+            flush_tlb_page(s->pd, va);
+            slot_count[slot] = 2;  // the PTE and the write in flight
+            writing[s->n].slot = slot;
+            writing[s->n].page = page;
+            s->n++;
+        }
+    }
+    return --s->budget == 0 || s->n == SWAP_BATCH;
+}
+
+// walk `table` at `level` (0 to 3) from `s->va`. return true to stop.
+static bool scan_table(Scan *s, PTEntriesPtr table, int level, u64 base) {
+    int shift = 39 - 9 * level;
+    usize i = s->va > base ? (s->va - base) >> shift : 0;
+    for (; i < N_PTE_PER_TABLE; i++) {
+        u64 va = base + ((u64)i << shift);
+        s->va = va + (1ull << shift);
+        if (level == 3) {
+            if (scan_pte(s, &table[i], va))
+                return true;
+        } else if ((table[i] & PTE_TABLE) == PTE_TABLE) {
+            if (scan_table(s, PTE(table[i]), level + 1, va))
+                return true;
+        }
+    }
+    return false;
+}
+
+// swap out a batch of pages of the next address space. return how many.
+static usize swap_out_batch() {
+    acquire_spinlock(&list_lock);
+    if (_empty_list(&pgdirs)) {
+        release_spinlock(&list_lock);
+        return 0;
+    }
+    struct pgdir *pd = container_of(pgdirs.next, struct pgdir, swapnode);
+    _detach_from_list(&pd->swapnode);
+    _insert_into_list(pgdirs.prev, &pd->swapnode);
+    acquire_spinlock(&pd->lock);
+    release_spinlock(&list_lock);
+
+    Scan s = {.pd = pd, .va = pd->swap_hand, .budget = SCAN_BUDGET, .n = 0};
+    acquire_spinlock(&swap_lock);
+    bool stopped = pd->pt && scan_table(&s, pd->pt, 0, 0);
+    release_spinlock(&swap_lock);
+    pd->swap_hand = stopped ? s.va : 0;
+    release_spinlock(&pd->lock);
+
+    for (usize i = 0; i < s.n; i++) {
+        usize slot = writing[i].slot;
+        slot_rw(slot, writing[i].page, true);
+        acquire_spinlock(&swap_lock);
+        void *page = writing[i].page;
+        writing[i].page = NULL;
+        release_spinlock(&swap_lock);
+        kfree_page(page);
+        put_slot(slot);
+    }
+    printk("kswapd: swapped out %lld pages\n", s.n);
+    return s.n;
+}
+
+static NO_RETURN void kswapd(u64 arg) {
+    (void)arg;
+    while (true) {
+        unalertable_wait_sem(&kswapd_sem);
+        __atomic_store_n(&kswapd_pending, false, __ATOMIC_RELEASE);
+
+        // dirty file pages can only be dropped after they are written back.
+        pagecache_kick_writeback();
+
+        // cached clean data is cheaper to drop than anything to swap out.
+        u64 left = left_page_cnt();
+        if (left < HIGH_WATERMARK_PAGES)
+            shrink_caches(HIGH_WATERMARK_PAGES - left);
+
+        for (int idle = 0; left_page_cnt() < HIGH_WATERMARK_PAGES && idle < MAX_IDLE_BATCHES;)
+            idle = swap_out_batch() ? 0 : idle + 1;
+        post_all_sem(&reclaim_sem);
+    }
+}
+
+static void wake_timer_handler(struct timer *t) {
+    (void)t;
+    if (!__atomic_exchange_n(&kswapd_pending, true, __ATOMIC_ACQ_REL))
+        post_sem(&kswapd_sem);
+}
+
+void wakeup_kswapd() {
+    if (!kswapd_ready || __atomic_load_n(&kswapd_pending, __ATOMIC_ACQUIRE))
+        return;
+    struct timer *t = &wake_timer[cpuid()];
+    if (t->triggered)
+        set_cpu_timer(t);
+}
+
+void wait_for_reclaim() {
+    // waking kswapd under the lock: its next `post_all_sem` cannot be missed.
+    _lock_sem(&reclaim_sem);
+    wakeup_kswapd();
+    ASSERT(_wait_sem(&reclaim_sem, false));
+}
+
+void init_swap() {
+    init_spinlock(&list_lock);
+    init_list_node(&pgdirs);
+    init_spinlock(&swap_lock);
+    find_swap_partition();
+    init_sem(&kswapd_sem, 0);
+    init_sem(&reclaim_sem, 0);
+    for (int i = 0; i < NCPU; i++) {
+        wake_timer[i].triggered = true;
+        wake_timer[i].elapse = 0;
+        wake_timer[i].handler = wake_timer_handler;
+    }
+    start_proc(create_proc(), kswapd, 0);
+    kswapd_ready = true;
+}
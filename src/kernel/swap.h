@@ -0,0 +1,69 @@
+#pragma once
+
+#include <aarch64/mmu.h>
+#include <common/defines.h>
+#include <fs/defines.h>
+#include <kernel/pt.h>
+
+/**
+    @brief the swap area is the third partition of the disk, of type Linux
+    swap (see `boot/generate-image.py`), found in the partition table by
+    `init_swap`. It is divided into page sized slots, at most so many are
+    used. Without it nothing is swapped out.
+ */
+#define SWAP_PARTITION 2
+#define SWAP_PARTITION_TYPE 0x82
+#define SWAP_SECTORS_PER_SLOT (PAGE_SIZE / BLOCK_SIZE)
+#define SWAP_MAX_SLOTS 65536
+
+/**
+    @brief a swapped out page is an invalid PTE holding its slot.
+
+    Bit 0 (valid) is clear, so the MMU ignores the rest: bit 1 marks the
+    entry as a swap entry, and bits 12 and above are the slot number.
+ */
+#define PTE_SWAPPED (1 << 1)
+#define SWAP_PTE(slot) ((u64)(slot) << 12 | PTE_SWAPPED)
+#define SWAP_SLOT(pte) ((usize)(pte) >> 12)
+#define is_swap_pte(pte) (((pte) & (PTE_VALID | PTE_SWAPPED)) == PTE_SWAPPED)
+
+/**
+    @brief the reclaimer (kswapd) is woken up when free pages drop below the
+    low watermark, and swaps pages out until they are above the high one.
+ */
+#define LOW_WATERMARK_PAGES 2048
+#define HIGH_WATERMARK_PAGES 4096
+
+void init_swap();
+
+/**
+    @brief let the reclaimer run soon. Safe to call from anywhere, including
+    `kalloc_page` with any lock held: the wakeup itself is deferred to the
+    next timer interrupt of this CPU.
+ */
+void wakeup_kswapd();
+
+/**
+    @brief sleep until the reclaimer finished a round.
+ */
+void wait_for_reclaim();
+
+/**
+    @brief make the anonymous pages of `pd` candidates for swapping out /
+    stop it. `pd` must be removed before its page table is torn down.
+ */
+void swap_add_pgdir(struct pgdir *pd);
+void swap_remove_pgdir(struct pgdir *pd);
+
+/**
+    @brief read the page of swap entry `*pte` back and map it there.
+
+    @note `*pte` must be a swap entry of the current process.
+ */
+void swap_in(PTEntry *pte);
+
+/**
+    @brief take / drop one reference of the slot in swap entry `pte`.
+ */
+void swap_dup(PTEntry pte);
+void swap_free(PTEntry pte);
@@ -36,46 +36,28 @@ void syscall_entry(UserContext *context) {
     x[0] = func(x[0], x[1], x[2], x[3], x[4], x[5]);
 }
 
-/**
- * Check if the virtual address [start,start+size) is READABLE by the current
- * user process.
- */
-bool user_readable(const void *start, usize size) {
-    for (u64 i = (u64)start; i < (u64)start + size; i = (i / BLOCK_SIZE + 1) * BLOCK_SIZE) {
-        PTEntry *pte = get_pte(&thisproc()->pgdir, i, false);
-        if (pte == NULL || (*pte & PTE_USER) == 0) {
-            return false;
-        }
-    }
-    return true;
+#define USERTOP (1 + ~KSPACE_MASK)  // 0x0001000000000000
+
+usize __copy_user(void *dst, const void *src, usize n);
+isize __strncpy_from_user(char *dst, const char *src, usize n);
+
+// is [p, p + n) in the user address space?
+static INLINE bool user_range(const void *p, usize n) {
+    return (u64)p <= USERTOP && n <= USERTOP - (u64)p;
 }
 
-/**
- * Check if the virtual address [start,start+size) is READABLE & WRITEABLE by
- * the current user process.
- */
-bool user_writeable(const void *start, usize size) {
-    for (u64 i = (u64)start; i < (u64)start + size; i = (i / BLOCK_SIZE + 1) * BLOCK_SIZE) {
-        PTEntry *pte = get_pte(&thisproc()->pgdir, i, false);
-        if (pte == NULL || (*pte & PTE_RO) || (*pte & PTE_USER) == 0) {
-            return false;
-        }
-    }
-    return true;
+usize copy_from_user(void *dst, const void *src, usize n) {
+    return user_range(src, n) ? __copy_user(dst, src, n) : n;
 }
 
-/**
- * Get the length of a string including tailing '\0' in the memory space of
- * current user process return 0 if the length exceeds maxlen or the string is
- * not readable by the current user process.
- */
-usize user_strlen(const char *str, usize maxlen) {
-    for (usize i = 0; i < maxlen; i++) {
-        if (user_readable(&str[i], 1)) {
-            if (str[i] == 0)
-                return i + 1;
-        } else
-            return 0;
-    }
-    return 0;
-}
\ No newline at end of file
+usize copy_to_user(void *dst, const void *src, usize n) {
+    return user_range(dst, n) ? __copy_user(dst, src, n) : n;
+}
+
+isize strncpy_from_user(char *dst, const char *src, usize n) {
+    if ((u64)src >= USERTOP)
+        return -1;
+    usize m = MIN(n, USERTOP - (u64)src);
+    isize len = __strncpy_from_user(dst, src, m);
+    return len == (isize)m && m < n ? -1 : len;  // runs off the user space
+}
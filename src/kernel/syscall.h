@@ -1,5 +1,6 @@
 #include <kernel/proc.h>
 #include <kernel/syscallno.h>
+#include <kernel/uaccess.h>
 #include <kernel/proc.h>
 
 #define NR_SYSCALL 512
@@ -25,7 +26,3 @@ void init_syscall();
         syscall_table[SYS_##name] = &sys_##name; \
     }                                            \
     static u64 sys_##name(__VA_ARGS__)
-
-bool user_readable(const void *start, usize size);
-bool user_writeable(const void *start, usize size);
-usize user_strlen(const char *str, usize maxlen);
\ No newline at end of file
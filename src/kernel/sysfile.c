@@ -20,6 +20,7 @@
 #include <fs/inode.h>
 #include <fs/pipe.h>
 #include <kernel/mem.h>
+#include <kernel/pagecache.h>
 #include <kernel/paging.h>
 #include <kernel/printk.h>
 #include <kernel/proc.h>
@@ -63,6 +64,17 @@ int fdalloc(struct file *f) {
     return -1;
 }
 
+#define MAX_PATH_LENGTH 256
+
+/*
+ * Copy the path argument `upath` in. `path` has MAX_PATH_LENGTH bytes.
+ * Return false if it is not readable or too long.
+ */
+static bool fetch_path(char *path, const char *upath) {
+    isize n = strncpy_from_user(path, upath, MAX_PATH_LENGTH);
+    return n >= 0 && n < MAX_PATH_LENGTH;
+}
+
 define_syscall(ioctl, int fd, u64 request) {
     // 0x5413 is TIOCGWINSZ (I/O Control to Get the WINdow SIZe, a magic request
     // to get the stdin terminal size) in our implementation. Just ignore it.
@@ -78,7 +90,7 @@ define_syscall(mmap, void *addr, size_t length, int prot, int flags, int fd, off
         "\e[0m",
         addr, (long long)length, prot, flags, fd, (long long)offset);
 
-    if (length <= 0 || (prot & PROT_EXEC) || (flags & MAP_ANONYMOUS)) {
+    if (length <= 0 || (prot & PROT_EXEC) || (flags & MAP_ANONYMOUS) || offset % PAGE_SIZE) {
         printk("sys_mmap: length, prot, flags unimplemented\n");
         return -1;
     }
@@ -134,7 +146,12 @@ define_syscall(mmap, void *addr, size_t length, int prot, int flags, int fd, off
     file_dup(f);
     sec->offset = offset;
     sec->length = size;
+    sec->advice = MADV_NORMAL;
+    sec->ra_start = sec->ra_size = sec->ra_prev = 0;
+    sec->pgdir = &thisproc()->pgdir;
     _insert_into_list(&thisproc()->pgdir.section_head, &sec->stnode);
+    if (flags & MAP_SHARED)
+        pagecache_add_mapping(sec);
 
     inodes.unlock(ip);
     bcache.end_op(&ctx);
@@ -169,27 +186,19 @@ define_syscall(munmap, u64 addr, size_t length) {
         return -1;
     }
 
-    if (sec->mmap_flags & MAP_SHARED) {
-        for (u64 va = aligned_addr; va < aligned_addr + aligned_len; va += PAGE_SIZE) {
-            PTEntry *pte = get_pte(&thisproc()->pgdir, va, false);
-            if (pte && *pte) {
-                void *pa = (void *)P2K(PTE_ADDRESS(*pte));
-                usize offset = sec->offset + (va - sec->begin);
-                inodes.write(NULL, sec->fp->ip, pa, offset, PAGE_SIZE);
-            }
-        }
-    }
+    if (sec->mmap_flags & MAP_SHARED)
+        filemap_writeback(sec, MAX(aligned_addr, sec->begin),
+                          MIN(aligned_addr + aligned_len, sec->end));
 
-    for (u64 va = aligned_addr; va < aligned_addr + aligned_len; va += PAGE_SIZE) {
-        PTEntry *pte = get_pte(&thisproc()->pgdir, va, false);
-        if (pte && *pte) {
-            kfree_page((void *)P2K(PTE_ADDRESS(*pte)));
-            *pte = 0;
-        }
-    }
+    acquire_spinlock(&thisproc()->pgdir.lock);  // against the reclaimer
+    clear_user_range(&thisproc()->pgdir, aligned_addr, aligned_addr + aligned_len);
+    release_spinlock(&thisproc()->pgdir.lock);
+    flush_tlb_range(&thisproc()->pgdir, aligned_addr, aligned_addr + aligned_len);
 
     if (aligned_addr == sec->begin && aligned_addr + aligned_len >= sec->end) {
         _detach_from_list(&sec->stnode);
+        if (sec->mmap_flags & MAP_SHARED)
+            pagecache_remove_mapping(sec);
         if (sec->fp) {
             file_close(sec->fp);
         }
@@ -199,6 +208,102 @@ define_syscall(munmap, u64 addr, size_t length) {
     return 0;
 }
 
+/*
+ * The readahead hints are kept per section, so they apply to every section
+ * the range touches. WILLNEED reads the file pages in the background.
+ * DONTNEED and FREE unmap the pages at once: anonymous memory reads as zeros
+ * afterwards, and file mappings fault the pages in from the page cache
+ * again. FREE only applies to anonymous memory. Neither applies to the
+ * sections loaded from the program or its stack, which cannot be refaulted.
+ */
+define_syscall(madvise, u64 addr, size_t length, int advice) {
+    if (addr % PAGE_SIZE)
+        return -1;
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_SEQUENTIAL:
+        case MADV_RANDOM:
+        case MADV_WILLNEED:
+        case MADV_DONTNEED:
+        case MADV_FREE: break;
+        default: return -1;
+    }
+
+    struct pgdir *pd = &thisproc()->pgdir;
+    u64 end = addr + round_up(length, PAGE_SIZE);
+    if (advice == MADV_DONTNEED || advice == MADV_FREE) {
+        for_list(pd->section_head) {
+            struct section *sec = container_of(p, struct section, stnode);
+            if (sec->end <= addr || end <= sec->begin)
+                continue;
+            bool anon = sec->flags & ST_HEAP;
+            if (!(anon || (sec->mmap_flags && advice == MADV_DONTNEED)))
+                return -1;
+        }
+    }
+
+    for_list(pd->section_head) {
+        struct section *sec = container_of(p, struct section, stnode);
+        if (sec->end <= addr || end <= sec->begin)
+            continue;
+        u64 begin = MAX(addr, PAGE_BASE(sec->begin)), stop = MIN(end, sec->end);
+        switch (advice) {
+            case MADV_WILLNEED: {
+                if (sec->mmap_flags)
+                    pagecache_readahead(sec->fp->ip, (sec->offset + begin - sec->begin) / PAGE_SIZE,
+                                        (stop - begin + PAGE_SIZE - 1) / PAGE_SIZE);
+            } break;
+            case MADV_DONTNEED:
+            case MADV_FREE: {
+                acquire_spinlock(&pd->lock);  // against the reclaimer
+                clear_user_range(pd, begin, stop);
+                release_spinlock(&pd->lock);
+                flush_tlb_range(pd, begin, stop);
+            } break;
+            default: {
+                sec->advice = advice;
+                sec->ra_size = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * MS_SYNC writes the dirty pages in the range back before returning,
+ * MS_ASYNC only wakes the writeback thread up.
+ */
+define_syscall(msync, u64 addr, size_t length, int flags) {
+    if (addr % PAGE_SIZE || ((flags & MS_SYNC) && (flags & MS_ASYNC)))
+        return -1;
+
+    u64 end = addr + round_up(length, PAGE_SIZE);
+    for_list(thisproc()->pgdir.section_head) {
+        struct section *sec = container_of(p, struct section, stnode);
+        if (!(sec->mmap_flags & MAP_SHARED) || sec->end <= addr || end <= sec->begin)
+            continue;
+        if (flags & MS_SYNC)
+            filemap_writeback(sec, MAX(addr, sec->begin), MIN(end, sec->end));
+        else
+            pagecache_kick_writeback();
+    }
+    if (flags & MS_SYNC)
+        bcache.flush();
+    return 0;
+}
+
+// write the dirty pages of shared mappings back, and wait for the journal,
+// whose `end_op` may return early, see `ASYNC_COMMIT`.
+define_syscall(fsync, int fd) {
+    struct file *f = fd2file(fd);
+    if (!f)
+        return -1;
+    if (f->type == FD_INODE)
+        pagecache_sync(f->ip, 0, (usize)-1);
+    bcache.flush();
+    return 0;
+}
+
 define_syscall(dup, int fd) {
     struct file *f = fd2file(fd);
     if (!f)
@@ -265,28 +370,33 @@ define_syscall(fcntl, int fd, int cmd, int arg) {
 
 define_syscall(read, int fd, char *buffer, int size) {
     struct file *f = fd2file(fd);
-    if (!f || !f->readable || size <= 0 || !user_writeable(buffer, size))
+    if (!f || !f->readable || size <= 0)
         return -1;
     return file_read(f, buffer, size);
 }
 
 define_syscall(write, int fd, char *buffer, int size) {
     struct file *f = fd2file(fd);
-    if (!f || !f->writable || size <= 0 || !user_readable(buffer, size))
+    if (!f || !f->writable || size <= 0)
         return -1;
     return file_write(f, buffer, size);
 }
 
 define_syscall(writev, int fd, struct iovec *iov, int iovcnt) {
     struct file *f = fd2file(fd);
-    struct iovec *p;
-    if (!f || iovcnt <= 0 || !user_readable(iov, sizeof(struct iovec) * iovcnt))
+    if (!f || iovcnt <= 0)
         return -1;
     usize tot = 0;
-    for (p = iov; p < iov + iovcnt; p++) {
-        if (!user_readable(p->iov_base, p->iov_len))
+    for (int i = 0; i < iovcnt; i++) {
+        struct iovec v;
+        if (copy_from_user(&v, &iov[i], sizeof(v)))
             return -1;
-        tot += file_write(f, p->iov_base, p->iov_len);
+        if (v.iov_len == 0)
+            continue;
+        isize n = file_write(f, v.iov_base, v.iov_len);
+        if (n < 0)
+            return tot ? (isize)tot : -1;
+        tot += n;
     }
     return tot;
 }
@@ -302,13 +412,16 @@ define_syscall(close, int fd) {
 
 define_syscall(fstat, int fd, struct stat *st) {
     struct file *f = fd2file(fd);
-    if (!f || !user_writeable(st, sizeof(*st)))
+    struct stat kst;
+    if (!f || file_stat(f, &kst) < 0 || copy_to_user(st, &kst, sizeof(kst)))
         return -1;
-    return file_stat(f, st);
+    return 0;
 }
 
-define_syscall(newfstatat, int dirfd, const char *path, struct stat *st, int flags) {
-    if (!user_strlen(path, 256) || !user_writeable(st, sizeof(*st)))
+define_syscall(newfstatat, int dirfd, const char *upath, struct stat *st, int flags) {
+    char path[MAX_PATH_LENGTH];
+    struct stat kst;
+    if (!fetch_path(path, upath))
         return -1;
     if (dirfd != AT_FDCWD) {
         printk("sys_fstatat: dirfd unimplemented\n");
@@ -327,12 +440,12 @@ define_syscall(newfstatat, int dirfd, const char *path, struct stat *st, int fla
         return -1;
     }
     inodes.lock(ip);
-    stati(ip, st);
+    stati(ip, &kst);
     inodes.unlock(ip);
     inodes.put(&ctx, ip);
     bcache.end_op(&ctx);
 
-    return 0;
+    return copy_to_user(st, &kst, sizeof(kst)) ? -1 : 0;
 }
 
 static int isdirempty(Inode *dp) {
@@ -348,13 +461,12 @@ static int isdirempty(Inode *dp) {
     return 1;
 }
 
-define_syscall(unlinkat, int fd, const char *path, int flag) {
+define_syscall(unlinkat, int fd, const char *upath, int flag) {
     ASSERT(fd == AT_FDCWD && flag == 0);
     Inode *ip, *dp;
-    DirEntry de;
-    char name[FILE_NAME_MAX_LENGTH];
+    char name[FILE_NAME_MAX_LENGTH], path[MAX_PATH_LENGTH];
     usize off;
-    if (!user_strlen(path, 256))
+    if (!fetch_path(path, upath))
         return -1;
     OpContext ctx;
     bcache.begin_op(&ctx);
@@ -384,9 +496,8 @@ define_syscall(unlinkat, int fd, const char *path, int flag) {
         goto bad;
     }
 
-    memset(&de, 0, sizeof(de));
-    if (inodes.write(&ctx, dp, (u8 *)&de, off, sizeof(de)) != sizeof(de))
-        PANIC();
+    // through `remove`, which also forgets the name in the dentry cache.
+    inodes.remove(&ctx, dp, off);
     if (ip->entry.type == INODE_DIRECTORY) {
         dp->entry.num_links--;
         inodes.sync(&ctx, dp, true);
@@ -445,7 +556,7 @@ Inode *create(const char *path, short type, short major, short minor, OpContext
         return NULL;
     }
 
-    Inode *ip = inodes.get(inodes.alloc(ctx, type));
+    Inode *ip = inodes.get(inodes.alloc_near(ctx, type, dir->inode_no));
     ASSERT(ip != NULL);
     inodes.lock(ip);
     // bcache.end_op(ctx);
@@ -465,15 +576,15 @@ Inode *create(const char *path, short type, short major, short minor, OpContext
     return ip;
 }
 
-define_syscall(openat, int dirfd, const char *path, int omode) {
-    printk("sys_openat: path '%s', omode %d\n", path, omode);
-
+define_syscall(openat, int dirfd, const char *upath, int omode) {
     int fd;
     struct file *f;
     Inode *ip;
+    char path[MAX_PATH_LENGTH];
 
-    if (!user_strlen(path, 256))
+    if (!fetch_path(path, upath))
         return -1;
+    printk("sys_openat: path '%s', omode %d\n", path, omode);
 
     if (dirfd != AT_FDCWD) {
         printk("sys_openat: dirfd unimplemented\n");
@@ -527,9 +638,10 @@ define_syscall(openat, int dirfd, const char *path, int omode) {
     return fd;
 }
 
-define_syscall(mkdirat, int dirfd, const char *path, int mode) {
+define_syscall(mkdirat, int dirfd, const char *upath, int mode) {
     Inode *ip;
-    if (!user_strlen(path, 256))
+    char path[MAX_PATH_LENGTH];
+    if (!fetch_path(path, upath))
         return -1;
     if (dirfd != AT_FDCWD) {
         printk("sys_mkdirat: dirfd unimplemented\n");
@@ -554,10 +666,11 @@ define_syscall(mkdirat, int dirfd, const char *path, int mode) {
     return 0;
 }
 
-define_syscall(mknodat, int dirfd, const char *path, mode_t mode, dev_t dev) {
+define_syscall(mknodat, int dirfd, const char *upath, mode_t mode, dev_t dev) {
     (void)mode;
     Inode *ip;
-    if (!user_strlen(path, 256))
+    char path[MAX_PATH_LENGTH];
+    if (!fetch_path(path, upath))
         return -1;
     if (dirfd != AT_FDCWD) {
         printk("sys_mknodat: dirfd unimplemented\n");
@@ -579,11 +692,14 @@ define_syscall(mknodat, int dirfd, const char *path, mode_t mode, dev_t dev) {
     return 0;
 }
 
-define_syscall(chdir, const char *path) {
+define_syscall(chdir, const char *upath) {
     /**
      * Change the cwd (current working dictionary) of current process to 'path'.
      */
 
+    char path[MAX_PATH_LENGTH];
+    if (!fetch_path(path, upath))
+        return -1;
     OpContext ctx;
     bcache.begin_op(&ctx);
     Inode *ip = namei(path, &ctx);
@@ -612,15 +728,17 @@ define_syscall(pipe2, int pipefd[2], int flags) {
         return -1;
     if (pipe_alloc(&rf, &wf) < 0)
         return -1;
-    int fd0 = fdalloc(rf), fd1 = fdalloc(wf);
-    if (fd0 < 0 || fd1 < 0) {
-        if (fd0 >= 0)
-            thisproc()->oftable.openfile[fd0] = 0;
+    int fds[2] = {fdalloc(rf), -1};
+    if (fds[0] >= 0)
+        fds[1] = fdalloc(wf);
+    if (fds[1] < 0 || copy_to_user(pipefd, fds, sizeof(fds))) {
+        if (fds[0] >= 0)
+            thisproc()->oftable.openfile[fds[0]] = 0;
+        if (fds[1] >= 0)
+            thisproc()->oftable.openfile[fds[1]] = 0;
         file_close(rf);
         file_close(wf);
         return -1;
     }
-    pipefd[0] = fd0;
-    pipefd[1] = fd1;
     return 0;
 }
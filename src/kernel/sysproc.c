@@ -1,3 +1,4 @@
+#include <kernel/ksm.h>
 #include <kernel/mem.h>
 #include <kernel/paging.h>
 #include <kernel/printk.h>
@@ -30,6 +31,20 @@ define_syscall(yield) {
 
 define_syscall(pstat) { return (u64)left_page_cnt(); }
 
+/*
+ * Turn the merging scanner on (run = 1) or off (run = 0), or leave it
+ * (run < 0). Its statistics are copied to `st` if not NULL.
+ */
+define_syscall(ksm, int run, struct ksmstat *st) {
+    if (run >= 0)
+        ksm_set_run(run);
+    struct ksmstat kst;
+    ksm_get_stat(&kst);
+    if (st && copy_to_user(st, &kst, sizeof(kst)))
+        return -1;
+    return 0;
+}
+
 define_syscall(sbrk, i64 size) { return sbrk(size); }
 
 define_syscall(clone, int flag, void *childstk) {
@@ -49,9 +64,11 @@ define_syscall(exit_group, int n) { exit(n); }
 
 int execve(const char *path, char *const argv[], char *const envp[]);
 define_syscall(execve, const char *p, void *argv, void *envp) {
-    if (!user_strlen(p, 256))
+    char path[256];
+    isize n = strncpy_from_user(path, p, sizeof(path));
+    if (n < 0 || (usize)n == sizeof(path))
         return -1;
-    return execve(p, argv, envp);
+    return execve(path, argv, envp);
 }
 
 define_syscall(wait4, int pid, int *wstatus, int options, void *rusage) {
@@ -61,5 +78,9 @@ define_syscall(wait4, int pid, int *wstatus, int options, void *rusage) {
                pid, wstatus, options, rusage);
         return -1;
     }
-    return wait(wstatus);
+    int status;
+    int child = wait(&status);
+    if (child >= 0 && wstatus && copy_to_user(wstatus, &status, sizeof(status)))
+        return -1;
+    return child;
 }
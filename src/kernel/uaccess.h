@@ -0,0 +1,21 @@
+#pragma once
+
+#include <common/defines.h>
+
+/**
+ * Copy between the kernel and the memory of the current user process. User
+ * memory is accessed directly: a bad address faults and the fault is fixed
+ * up to fail the copy (see `aarch64/uaccess.S`), so nothing is checked in
+ * advance.
+ *
+ * Return the number of bytes NOT copied, 0 on success.
+ */
+WARN_RESULT usize copy_from_user(void *dst, const void *src, usize n);
+WARN_RESULT usize copy_to_user(void *dst, const void *src, usize n);
+
+/**
+ * Copy a string of at most `n` bytes including the tailing '\0' from the
+ * current user process. Return its length, `n` if it is longer, or -1 if
+ * it is not readable.
+ */
+WARN_RESULT isize strncpy_from_user(char *dst, const char *src, usize n);
@@ -32,7 +32,7 @@ typedef uint32_t uint;
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 #define BSIZE BLOCK_SIZE
-#define LOGSIZE LOG_MAX_SIZE
+#define LOGSIZE (LOG_HEADER_BLOCKS + LOG_MAX_SIZE)
 #define NDIRECT INODE_NUM_DIRECT
 #define NINDIRECT INODE_NUM_INDIRECT
 #define DIRSIZ FILE_NAME_MAX_LENGTH